@@ -0,0 +1,67 @@
+// Throughput of the json module on a document of about 1 MB, through the
+// same function values a Pa program calls. Prints `name ns/KB` lines in
+// the format of runtime.cc.
+#include <palang.h>
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double start, double kb) {
+    printf("%s %.2f\n", name, (now() - start) * 1e9 / kb);
+}
+
+static pa_value_t* call(pa_value_t* f, pa_list_t args) {
+    return pa_function_call(f, args, pa_dict_t{}, pa_new_nil());
+}
+
+int main(int argc, char** argv, char** env) {
+    PA_ENTER(argc, argv, env);
+    pa_value_t* json = pa_import("json");
+    pa_value_t* parse = pa_module_member(json, "parse");
+    pa_value_t* stringify = pa_module_member(json, "stringify");
+    pa_value_t* parser = pa_module_member(json, "parser");
+    pa_value_t* feed = pa_module_member(json, "feed");
+    const int rounds = 10;
+    double start;
+    pa_value_t* v;
+
+    pa_value_t* doc = pa_new_list();
+    for(int i = 0; i < 10000; i++) {
+        PV2LIST(doc)->push_back(pa_new_dictionary(
+            pa_new_dictionary_kv(pa_new_string("id"), pa_new_integer(i)),
+            pa_new_dictionary_kv(pa_new_string("name"), pa_new_string("user \"" + to_string(i) + "\"")),
+            pa_new_dictionary_kv(pa_new_string("score"), pa_new_float(i * 0.37)),
+            pa_new_dictionary_kv(pa_new_string("active"), pa_new_boolean(i % 2 == 0)),
+            pa_new_dictionary_kv(pa_new_string("tags"), pa_new_list(pa_new_string("alpha"), pa_new_string("beta"))),
+            pa_new_dictionary_kv(pa_new_string("bio"), pa_new_string("a longer string that the scanner skips sixteen bytes at a time"))
+        ));
+    }
+    pa_value_t* text = call(stringify, pa_list_t{doc});
+    double kb = PV2STR(text)->size() / 1024.0;
+
+    start = now();
+    for(int i = 0; i < rounds; i++) v = call(stringify, pa_list_t{doc});
+    report("json_stringify_kb", start, kb * rounds);
+
+    start = now();
+    for(int i = 0; i < rounds; i++) v = call(parse, pa_list_t{text});
+    report("json_parse_kb", start, kb * rounds);
+
+    // The document cut into 4 KB chunks, as they would come off a socket.
+    pa_list_t chunks;
+    for(size_t at = 0; at < PV2STR(text)->size(); at += 4096) {
+        chunks.push_back(pa_new_string(PV2STR(text)->substr(at, 4096)));
+    }
+    start = now();
+    for(int i = 0; i < rounds; i++) {
+        pa_value_t* stream = call(parser, pa_list_t{});
+        for(pa_list_t::iterator it = chunks.begin(); it != chunks.end(); ++it) v = call(feed, pa_list_t{stream, *it});
+    }
+    report("json_feed_4k_kb", start, kb * rounds);
+
+    return PA_LEAVE(v);
+}
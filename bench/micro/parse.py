@@ -0,0 +1,77 @@
+# Parse throughput of the pypac front end on synthetic sources, in the
+# `name ns/op` format of runtime.cc: per source line and per KB.
+#
+#   python bench/micro/parse.py [--lines N] [--repeat R] [--dump FILE]
+#
+# The generated program mixes classes, functions, control flow, literals and
+# the whole operator table, so every rule of the grammar is exercised. The
+# peak RSS bench/run.py records for it is the parser's.
+import sys, os, time
+from optparse import OptionParser
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "pypac"))
+import parser
+
+CHUNK = '''# chunk %(n)d
+class Point%(n)d {
+    property x = 0
+    property y = 0
+    constructor(self, x, y=0) {
+        self.x = x
+        self.y = y
+    }
+    method length(self) = self.x * self.x + self.y * self.y
+    operator +(self, o) = new Point%(n)d(self.x + o.x, self.y + o.y)
+    operator getattr(self, k) = nil
+}
+fib%(n)d(n) {
+    if n < 2, = n
+    = fib%(n)d(n - 1) + fib%(n)d(n - 2)
+}
+total%(n)d = 0
+for i in range(%(n)d) {
+    if i mod 3 == 0 and not (i > 10 or i <= -1) {
+        total%(n)d = total%(n)d + i * 2 / 1.5e0
+    } elif i != 7 {
+        continue
+    } else, break
+}
+while total%(n)d >= 100, total%(n)d = total%(n)d - 100
+try {
+    d = {"key": [1, 2.5, "three", true, nil], 2: {}}
+    raise d["key"][0]
+} except Exception e {
+    print("caught\\n", e)
+} finally, print("done")
+squares%(n)d = range(10) -> func(x) = x * x
+v%(n)d = var { a = [fib%(n)d(5), Point%(n)d(1, y=2).length()]; = a }
+'''
+CHUNK_LINES = CHUNK.count("\n")
+
+def generate(lines):
+    return "".join([CHUNK % {"n": n} for n in range(lines / CHUNK_LINES + 1)])
+
+def main():
+    opt = OptionParser()
+    opt.add_option("--lines", dest="lines", type="int", default=20000, help="size of the synthetic source")
+    opt.add_option("--repeat", dest="repeat", type="int", default=3, help="number of timed runs")
+    opt.add_option("--dump", dest="dump", default=None, help="write the synthetic source to FILE", metavar="FILE")
+    options, _ = opt.parse_args()
+
+    source = generate(options.lines)
+    if options.dump:
+        open(options.dump, "w").write(source)
+    lines = source.count("\n")
+
+    best = None
+    for _ in range(options.repeat):
+        start = time.time()
+        parser.parse(source)
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+
+    print "parse_line %.2f" % (best * 1e9 / lines)
+    print "parse_kb %.2f" % (best * 1e9 / (len(source) / 1024.0))
+
+if __name__ == "__main__":
+    main()
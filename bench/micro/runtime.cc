@@ -0,0 +1,78 @@
+// Microbenchmarks of palang.h primitives, without the compiler in the way.
+// Prints one `name ns/op` line per case; bench/run.py builds it through
+// pypac and records the numbers.
+#include <palang.h>
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double start, long n) {
+    printf("%s %.2f\n", name, (now() - start) * 1e9 / n);
+}
+
+static pa_value_t* identity(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    return args.front();
+}
+
+int main(int argc, char** argv, char** env) {
+    PA_ENTER(argc, argv, env);
+    const long n = 1000000;
+    double start;
+    pa_value_t* v;
+
+    v = pa_new_integer(0);
+    start = now();
+    for(long i = 0; i < n; i++) v = pa_operator_add(v, pa_new_integer(1));
+    report("integer_add", start, n);
+
+    pa_value_t* l = pa_new_list();
+    for(long i = 0; i < 64; i++) PV2LIST(l)->push_back(pa_new_integer(i));
+    pa_value_t* index = pa_new_integer(32);
+    start = now();
+    for(long i = 0; i < n; i++) v = pa_operator_getitem(l, index);
+    report("list_getitem_32", start, n);
+
+    pa_value_t* d = pa_new_dictionary(
+        pa_new_dictionary_kv(pa_new_string("alpha"), pa_new_integer(1)),
+        pa_new_dictionary_kv(pa_new_string("beta"), pa_new_integer(2)),
+        pa_new_dictionary_kv(pa_new_string("gamma"), pa_new_integer(3))
+    );
+    pa_value_t* key = pa_new_string("beta");
+    start = now();
+    for(long i = 0; i < n; i++) v = pa_operator_getitem(d, key);
+    report("dict_getitem", start, n);
+
+    pa_value_t* s = pa_new_string("hello");
+    pa_value_t* t = pa_new_string(", world");
+    start = now();
+    for(long i = 0; i < n; i++) v = pa_operator_add(s, t);
+    report("string_add", start, n);
+
+    pa_value_t* f = pa_new_function(identity);
+    start = now();
+    for(long i = 0; i < n; i++) v = pa_function_call(f, pa_list_t{index}, pa_dict_t{}, pa_new_nil());
+    report("function_call", start, n);
+
+    pa_value_t* cls = pa_new_class();
+    cls->value.cls->set_operator(pa_op_add, f);
+    pa_value_t* o = pa_new_object(cls->value.cls);
+    start = now();
+    for(long i = 0; i < n; i++) v = pa_operator_add(o, index);
+    report("object_add", start, n);
+
+    start = now();
+    for(long i = 0; i < n / 10; i++) {
+        try {
+            pa_operator_divide(index, pa_new_integer(0));
+        } catch(pa_value_t* e) {
+            v = e;
+        }
+    }
+    report("exception", start, n / 10);
+
+    return PA_LEAVE(v);
+}
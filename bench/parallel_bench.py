@@ -0,0 +1,43 @@
+# Scaling of the parallel runtime across thread counts.
+#
+#   python bench/parallel_bench.py [--program FILE] [--threads N] [--repeat R]
+#
+# Builds a program from bench/suite/ once (parallel_map.pa for `->>`,
+# tasks.pa for spawn/await), then runs it with PA_THREADS=1..N and reports
+# the best wall time and the speedup over one thread.
+import sys, os, time, subprocess
+from optparse import OptionParser
+from multiprocessing import cpu_count
+from tempfile import mkdtemp
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.join(BENCH_DIR, "..")
+
+def main():
+    opt = OptionParser()
+    opt.add_option("--program", dest="program", default="parallel_map.pa", help="benchmark in bench/suite/", metavar="FILE")
+    opt.add_option("--threads", dest="threads", type="int", default=cpu_count(), help="highest thread count")
+    opt.add_option("--repeat", dest="repeat", type="int", default=3, help="number of timed runs per thread count")
+    options, _ = opt.parse_args()
+
+    binary = os.path.join(mkdtemp(), options.program.split(".")[0])
+    if subprocess.call([sys.executable, os.path.join(ROOT, "pypac"), os.path.join(BENCH_DIR, "suite", options.program), "-o", binary]):
+        print "build failed"
+        exit(1)
+
+    counts = sorted(set([1, 2, 4, 8, 16, 32, 64] + [options.threads]))
+    base = None
+    print "%8s %10s %8s" % ("threads", "best (s)", "speedup")
+    for n in [x for x in counts if x <= options.threads]:
+        env = dict(os.environ, PA_THREADS=str(n))
+        best = None
+        for _ in range(options.repeat):
+            start = time.time()
+            subprocess.check_call([binary], env=env, stdout=open(os.devnull, "w"))
+            elapsed = time.time() - start
+            best = elapsed if best is None else min(best, elapsed)
+        base = base or best
+        print "%8d %10.3f %7.2fx" % (n, best, base / best)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,85 @@
+# Request throughput of the PAW example, loaded at runtime and bundled.
+#
+#   python bench/paw_bench.py [--requests N] [--repeat R] [--path PATH]
+#
+# Builds libs/, examples/paw/libs/paw.pa and examples/paw/app.pa with the
+# same CXXFLAGS, once as usual and once with -b, then sends N sequential
+# requests to each server R times, alternating between the two. Reports the
+# median requests per second and the CPU time the server spent per request.
+# Both builds must come from the same flags: a libs/*.so left over from an
+# earlier build with other flags makes the comparison meaningless.
+import sys, os, time, socket, signal, subprocess
+from optparse import OptionParser
+from tempfile import mkdtemp
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.abspath(os.path.join(BENCH_DIR, ".."))
+PYPAC = os.path.join(ROOT, "pypac")
+PAW = os.path.join(ROOT, "examples", "paw")
+PORT = 3000
+
+def median(xs):
+    xs = sorted(xs)
+    return xs[len(xs) / 2] if len(xs) % 2 else (xs[len(xs) / 2 - 1] + xs[len(xs) / 2]) / 2.0
+
+def pypac(args, cwd):
+    p = subprocess.Popen([sys.executable, PYPAC] + args, cwd=cwd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out, _ = p.communicate()
+    if p.returncode:
+        print "pypac %s failed:\n%s" % (" ".join(args), out)
+        exit(1)
+
+def build(workdir):
+    libs = os.path.join(ROOT, "libs")
+    for x in sorted(os.listdir(libs)):
+        if x.endswith((".cc", ".pa")):
+            pypac([x, "-l", "-o", x.rsplit(".", 1)[0] + ".so"], libs)
+    pypac(["libs/paw.pa", "-l", "-o", "libs/paw.so"], PAW)
+    binaries = {"dynamic": os.path.join(workdir, "app"), "bundled": os.path.join(workdir, "app_b")}
+    pypac(["app.pa", "-o", binaries["dynamic"]], PAW)
+    pypac(["app.pa", "-b", "-o", binaries["bundled"]], PAW)
+    return binaries
+
+def request(path):
+    s = socket.create_connection(("127.0.0.1", PORT))
+    s.sendall("GET %s HTTP/1.0\r\nHost: localhost\r\n\r\n" % path)
+    while s.recv(65536):
+        pass
+    s.close()
+
+def run_once(binary, requests, path):
+    server = subprocess.Popen([binary], cwd=PAW, stdout=open(os.devnull, "w"), stderr=subprocess.STDOUT)
+    for _ in range(100):
+        try:
+            request(path)
+            break
+        except socket.error:
+            time.sleep(0.05)
+    start = time.time()
+    for _ in range(requests):
+        request(path)
+    elapsed = time.time() - start
+    server.send_signal(signal.SIGKILL)
+    _, _, usage = os.wait4(server.pid, 0)
+    return requests / elapsed, (usage.ru_utime + usage.ru_stime) * 1e6 / requests
+
+def main():
+    opt = OptionParser()
+    opt.add_option("--requests", dest="requests", type="int", default=5000, help="requests per run")
+    opt.add_option("--repeat", dest="repeat", type="int", default=5, help="number of runs per build")
+    opt.add_option("--path", dest="path", default="/hello/pa", help="path to request")
+    options, _ = opt.parse_args()
+
+    binaries = build(mkdtemp())
+    results = dict((x, []) for x in binaries)
+    for _ in range(options.repeat):
+        for name in ["dynamic", "bundled"]:
+            results[name].append(run_once(binaries[name], options.requests, options.path))
+    os.unlink(os.path.join(PAW, "libs", "paw.so"))
+
+    print "%8s %10s %14s" % ("build", "req/s", "server us/req")
+    for name in ["dynamic", "bundled"]:
+        print "%8s %10.0f %14.1f" % (name, median([x[0] for x in results[name]]), median([x[1] for x in results[name]]))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,165 @@
+# Benchmark suite runner and regression check.
+#
+#   python bench/run.py [--repeat R] [--output FILE] [--baseline FILE]
+#                       [--update-baseline] [--only NAME,...]
+#
+# Builds every program in bench/suite/ and bench/micro/ through pypac with
+# -DPA_STATS, runs each one R times and records the wall time, the peak RSS
+# and the boxed values it allocated. Python files in bench/micro/ measure
+# pypac itself and run as they are. The results go to FILE as JSON. When a
+# baseline exists (bench/baseline.json by default), every metric is compared
+# with it and the exit status is 1 if one got worse than its threshold.
+# --update-baseline stores the new results as the baseline instead.
+import sys, os, time, json, shutil, subprocess, platform
+from optparse import OptionParser
+from tempfile import mkdtemp
+from multiprocessing import cpu_count
+from multiprocessing.pool import ThreadPool
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.abspath(os.path.join(BENCH_DIR, ".."))
+PYPAC = os.path.join(ROOT, "pypac")
+
+# How much worse than the baseline a metric may get, as a fraction.
+THRESHOLDS = {"wall_s": 0.10, "peak_rss_kb": 0.10, "allocations": 0.01, "ns_per_op": 0.15}
+
+def median(xs):
+    xs = sorted(xs)
+    return xs[len(xs) / 2] if len(xs) % 2 else (xs[len(xs) / 2 - 1] + xs[len(xs) / 2]) / 2.0
+
+def pypac(args, env):
+    p = subprocess.Popen([sys.executable, PYPAC] + args, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out, _ = p.communicate()
+    if p.returncode:
+        raise Exception("pypac %s failed:\n%s" % (" ".join(args), out))
+
+def build_libs(env):
+    """Builds libs/ with one pypac per library, as many at once as there are CPUs."""
+    libs = os.path.join(ROOT, "libs")
+    sources = [x for x in sorted(os.listdir(libs)) if x.endswith((".cc", ".pa"))]
+    pool = ThreadPool(cpu_count())
+    try:
+        pool.map(lambda x: pypac([os.path.join(libs, x), "-l", "-o", os.path.join(libs, x.rsplit(".", 1)[0] + ".so")], env), sources)
+    finally:
+        pool.close()
+
+def run_once(command, cwd, env):
+    """Wall time, peak RSS (KB), stdout and the PA_STATS counters of one run."""
+    stats = os.path.join(cwd, "stats.json")
+    env = dict(env, PA_STATS_OUT=stats)
+    start = time.time()
+    p = subprocess.Popen(command, cwd=cwd, env=env, stdout=subprocess.PIPE)
+    out = p.stdout.read()
+    _, status, usage = os.wait4(p.pid, 0)
+    elapsed = time.time() - start
+    if status:
+        raise Exception("%s exited with status %d" % (" ".join(command), status))
+    counters = json.load(open(stats)) if os.path.isfile(stats) else {}
+    return elapsed, usage.ru_maxrss, out, counters
+
+def run_program(name, command, repeat, env):
+    cwd = mkdtemp()
+    try:
+        runs = [run_once(command, cwd, env) for _ in range(repeat)]
+    finally:
+        shutil.rmtree(cwd)
+    times = [x[0] for x in runs]
+    r = {
+        "wall_s": median(times),
+        "wall_s_min": min(times),
+        "runs": times,
+        "peak_rss_kb": max([x[1] for x in runs]),
+    }
+    r.update(runs[-1][3])
+    if name.startswith("micro."):
+        # Microbenchmarks print `case ns/op`; the best run of each case counts.
+        cases = {}
+        for _, _, out, _ in runs:
+            for line in out.splitlines():
+                k, v = line.split()
+                cases[k] = min(cases.get(k, float(v)), float(v))
+        r["cases"] = dict([(k, {"ns_per_op": v}) for k, v in cases.items()])
+    return r
+
+def metrics(results):
+    """Flattens results into {(benchmark, metric): value} for comparison."""
+    r = {}
+    for name, b in results["benchmarks"].items():
+        for k in ["wall_s", "peak_rss_kb", "allocations"]:
+            if k in b:
+                r[(name, k)] = b[k]
+        for case, c in b.get("cases", {}).items():
+            r[(name + "." + case, "ns_per_op")] = c["ns_per_op"]
+    return r
+
+def compare(results, baseline):
+    new, old = metrics(results), metrics(baseline)
+    regressions = 0
+    print "\n%-36s %-12s %14s %14s %8s" % ("benchmark", "metric", "baseline", "current", "change")
+    for key in sorted(new):
+        if key not in old:
+            continue
+        a, b = old[key], new[key]
+        change = (b - a) / float(a) if a else 0.0
+        worse = change > THRESHOLDS[key[1]]
+        regressions += worse
+        print "%-36s %-12s %14.4g %14.4g %+7.1f%%%s" % (key[0], key[1], a, b, change * 100, "  REGRESSION" if worse else "")
+    return regressions
+
+def main():
+    opt = OptionParser()
+    opt.add_option("--repeat", dest="repeat", type="int", default=5, help="runs per benchmark")
+    opt.add_option("--output", dest="output", default=os.path.join(BENCH_DIR, "results.json"), help="where to write the results", metavar="FILE")
+    opt.add_option("--baseline", dest="baseline", default=os.path.join(BENCH_DIR, "baseline.json"), help="results to compare with", metavar="FILE")
+    opt.add_option("--update-baseline", dest="update", default=False, help="store the results as the baseline", action="store_true")
+    opt.add_option("--only", dest="only", default=None, help="comma-separated benchmark names")
+    options, _ = opt.parse_args()
+
+    cxxflags = os.environ.get("CXXFLAGS", "-O3 -g -std=c++11 -pthread -ldl -lgc") + " -DPA_STATS"
+    env = dict(os.environ, CXXFLAGS=cxxflags, PA_HOME=ROOT)
+    programs = []
+    for d, prefix in [("suite", ""), ("micro", "micro.")]:
+        for x in sorted(os.listdir(os.path.join(BENCH_DIR, d))):
+            if x.endswith((".pa", ".cc")) or (d == "micro" and x.endswith(".py")):
+                programs.append((prefix + x.rsplit(".", 1)[0], os.path.join(BENCH_DIR, d, x)))
+    if options.only:
+        programs = [x for x in programs if x[0] in options.only.split(",")]
+
+    build_libs(env)
+    bindir = mkdtemp()
+    results = {
+        "meta": {
+            "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            "host": platform.node(),
+            "cxx": os.environ.get("CXX", "c++"),
+            "cxxflags": cxxflags,
+            "repeat": options.repeat,
+        },
+        "benchmarks": {}
+    }
+    try:
+        for name, path in programs:
+            if path.endswith(".py"):
+                command = [sys.executable, path]
+            else:
+                command = [os.path.join(bindir, name)]
+                pypac([path, "-o", command[0]], env)
+            r = run_program(name, command, options.repeat, env)
+            results["benchmarks"][name] = r
+            print "%-20s %8.3f s  %8d KB  %10s allocations" % (name, r["wall_s"], r["peak_rss_kb"], r.get("allocations", "-"))
+    finally:
+        shutil.rmtree(bindir)
+
+    json.dump(results, open(options.output, "w"), indent=2, sort_keys=True)
+    print "\nResults written to", options.output
+    if options.update:
+        shutil.copyfile(options.output, options.baseline)
+        print "Baseline updated:", options.baseline
+    elif os.path.isfile(options.baseline):
+        regressions = compare(results, json.load(open(options.baseline)))
+        if regressions:
+            print "\n%d regression(s) over the thresholds." % regressions
+            exit(1)
+
+if __name__ == "__main__":
+    main()
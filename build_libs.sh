@@ -4,5 +4,13 @@ echo PAC tcp.cc
 python pypac libs/tcp.cc -l -o libs/tcp.so
 echo PAC file.cc
 python pypac libs/file.cc -l -o libs/file.so
+echo PAC array.cc
+python pypac libs/array.cc -l -o libs/array.so
+echo PAC router.cc
+python pypac libs/router.cc -l -o libs/router.so
+echo PAC staticfile.cc
+python pypac libs/staticfile.cc -l -o libs/staticfile.so
+echo PAC json.cc
+python pypac libs/json.cc -l -o libs/json.so
 echo PAC string.pa
 python pypac libs/string.pa -l -o libs/string.so
@@ -13,17 +13,36 @@
 #include <string>
 #include <functional>
 #include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <dlfcn.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#define GC_THREADS
 #include <gc/gc.h>
 #include <gc/gc_cpp.h>
 #include <gc/gc_allocator.h>
+#if GC_VERSION_MAJOR >= 8
+#include <gc/gc_mark.h>
+#endif
 
 #define pa_string_t basic_string<char,char_traits<char>,gc_allocator<char>>
 #define pa_list_t list<pa_value_t*>
 #define pa_dict_t map<pa_string_t,pa_value_t*>
 #define pa_func_t function<pa_value_t*(pa_list_t,pa_dict_t,pa_value_t*)>
+#define pa_module_map_t map<pa_string_t,pa_value_t*,less<pa_string_t>,traceable_allocator<pair<const pa_string_t,pa_value_t*>>>
 
 #define PV2STR(x) (static_cast<pa_string_t*>((x)->value.ptr))
 #define PV2LIST(x) (static_cast<pa_list_t*>((x)->value.ptr))
@@ -41,15 +60,59 @@ enum pa_type_t {
     pa_dictionary,
     pa_function,
     pa_class,
-    pa_object
+    pa_object,
+    pa_array,
+    pa_future,
+    pa_sequence
 }; 
 
 class pa_value_t;
 class pa_object_data;
 class pa_class_data;
+class pa_array_data;
+class pa_future_data;
+class pa_sequence_data;
+
+// Allocation counters
+//
+// Builds with -DPA_STATS count the boxed values they allocate and report
+// the totals at exit as JSON, to $PA_STATS_OUT or else to stderr. The bench
+// runner reads them.
+#ifdef PA_STATS
+class pa_stats_t {
+    public:
+        atomic<uint64_t> allocations;
+        atomic<uint64_t> allocated_bytes;
+};
+
+inline void pa_stats_dump();
+
+inline pa_stats_t& pa_stats() {
+    static pa_stats_t stats;
+    static int registered = atexit(pa_stats_dump);
+    return stats;
+}
+
+inline void pa_stats_dump() {
+    const char* path = getenv("PA_STATS_OUT");
+    FILE* fp = path ? fopen(path, "w") : stderr;
+    if(!fp) return;
+    fprintf(fp, "{\"allocations\": %llu, \"allocated_bytes\": %llu}\n",
+            (unsigned long long)pa_stats().allocations.load(), (unsigned long long)pa_stats().allocated_bytes.load());
+    if(fp != stderr) fclose(fp);
+}
+#endif
 
 class pa_value_t : public gc {
     public:
+#ifdef PA_STATS
+        using gc::operator new;
+        static void* operator new(size_t size) {
+            pa_stats().allocations.fetch_add(1, memory_order_relaxed);
+            pa_stats().allocated_bytes.fetch_add(size, memory_order_relaxed);
+            return gc::operator new(size);
+        }
+#endif
         union {
             int8_t i8;
             int16_t i16;
@@ -66,19 +129,56 @@ class pa_value_t : public gc {
             pa_func_t* func;
             pa_class_data* cls;
             pa_object_data* obj;
+            pa_array_data* arr;
+            pa_future_data* future;
+            pa_sequence_data* seq;
         } value;
         enum pa_type_t type;
 };
 
+// Operators a class can define, in the order of the per-class table. The
+// compiler names them after the runtime functions (pa_op_add for `+`).
+enum pa_operator_id_t {
+    pa_op_constructor,
+    pa_op_destructor,
+    pa_op_add,
+    pa_op_subtract,
+    pa_op_multiply,
+    pa_op_divide,
+    pa_op_modulo,
+    pa_op_eq,
+    pa_op_neq,
+    pa_op_gt,
+    pa_op_gte,
+    pa_op_lt,
+    pa_op_lte,
+    pa_op_right,
+    pa_op_parallel_right,
+    pa_op_left,
+    pa_op_not,
+    pa_op_and,
+    pa_op_or,
+    pa_op_ref,
+    pa_op_query,
+    pa_op_bang,
+    pa_op_getattr,
+    pa_op_setattr,
+    pa_op_getitem,
+    pa_op_setitem,
+    pa_op_length,
+    pa_op_count
+};
+
 class pa_class_data : public gc {
     private:
         pa_dict_t members;
-        pa_dict_t operators;
+        pa_value_t* operators[pa_op_count];
     public:
+        pa_class_data() : operators() {}
         void set_member(pa_string_t name, pa_value_t* value) { this->members[name] = value; }
         pa_value_t* get_member(pa_string_t name) { return this->members[name]; }
-        void set_operator(pa_string_t name, pa_value_t* value) { this->operators[name] = value; }
-        pa_value_t* get_operator(pa_string_t name) { return this->operators[name]; }
+        void set_operator(pa_operator_id_t op, pa_value_t* value) { this->operators[op] = value; }
+        pa_value_t* get_operator(pa_operator_id_t op) const { return this->operators[op]; }
 };
 
 class pa_object_data : public gc {
@@ -89,9 +189,9 @@ class pa_object_data : public gc {
         pa_object_data() {}
         pa_object_data(pa_class_data* _class) { this->_class = _class; }
         pa_class_data* get_class() { return this->_class; }
-        pa_value_t* get_operator(pa_string_t name) { 
+        pa_value_t* get_operator(pa_operator_id_t op) { 
             if(this->_class) {
-                return this->_class->get_operator(name);
+                return this->_class->get_operator(op);
             } else {
                 return NULL;
             }
@@ -134,14 +234,31 @@ inline pa_value_t* pa_new_exception(pa_value_t* cls, const pa_string_t cause) {
     return o;
 }
 
-pa_value_t* _DivideByZeroException = pa_define_runtime_error("DivideByZeroException");
-pa_value_t* _NoSuchAttributeException = pa_define_runtime_error("NoSuchAttributeException");
-pa_value_t* _ArgumentRequiredException = pa_define_runtime_error("ArgumentRequiredException");
-pa_value_t* _OutOfIndexException = pa_define_runtime_error("OutOfIndexException");
-pa_value_t* _NotHashableException = pa_define_runtime_error("NotHashableException");
-pa_value_t* _NotCallableException = pa_define_runtime_error("NotCallableException");
-pa_value_t* _TypeMismatchException = pa_define_runtime_error("TypeMismatchException");
-pa_value_t* _ImportException = pa_define_runtime_error("ImportException");
+// Every exception class is created once per image, on first use, so the
+// header can be included from several translation units of one binary.
+#define PA_RUNTIME_ERROR(name) \
+    inline pa_value_t* _pa_runtime_error_##name() { \
+        static pa_value_t* c = pa_define_runtime_error(#name); \
+        return c; \
+    }
+
+PA_RUNTIME_ERROR(DivideByZeroException)
+PA_RUNTIME_ERROR(NoSuchAttributeException)
+PA_RUNTIME_ERROR(ArgumentRequiredException)
+PA_RUNTIME_ERROR(OutOfIndexException)
+PA_RUNTIME_ERROR(NotHashableException)
+PA_RUNTIME_ERROR(NotCallableException)
+PA_RUNTIME_ERROR(TypeMismatchException)
+PA_RUNTIME_ERROR(ImportException)
+
+#define _DivideByZeroException _pa_runtime_error_DivideByZeroException()
+#define _NoSuchAttributeException _pa_runtime_error_NoSuchAttributeException()
+#define _ArgumentRequiredException _pa_runtime_error_ArgumentRequiredException()
+#define _OutOfIndexException _pa_runtime_error_OutOfIndexException()
+#define _NotHashableException _pa_runtime_error_NotHashableException()
+#define _NotCallableException _pa_runtime_error_NotCallableException()
+#define _TypeMismatchException _pa_runtime_error_TypeMismatchException()
+#define _ImportException _pa_runtime_error_ImportException()
 
 
 // Types
@@ -159,6 +276,8 @@ inline bool pa_evaluate_into_boolean(pa_value_t* a) {
     switch(a->type) {
         case pa_integer:
                 return a->value.b;
+        case pa_float:
+                return a->value.f64 != 0;
         case pa_boolean:
                 return a->value.b;
         default:
@@ -183,6 +302,13 @@ inline pa_value_t* pa_new_integer(int64_t v) {
     return r;
 }
 
+inline pa_value_t* pa_new_float(double v) {
+    pa_value_t *r = new pa_value_t;
+    r->value.f64 = v;
+    r->type = pa_float;
+    return r;
+}
+
 #define pa_new_list(...) _pa_new_list(pa_list_t{ __VA_ARGS__ })
 inline pa_value_t* _pa_new_list(pa_list_t li) {
     pa_value_t *r = new pa_value_t;
@@ -216,19 +342,34 @@ inline pa_value_t* _pa_new_dictionary(pa_dict_t dict) {
 
 inline pa_value_t* pa_new_string(pa_string_t str) {
     pa_value_t *r = new pa_value_t;
-    r->value.ptr = (void*)new pa_string_t(str);
+    r->value.ptr = (void*)new pa_string_t(move(str));
     r->type = pa_string;
     return r;
 }
 
 inline pa_value_t* pa_new_function(pa_func_t f) {
     pa_value_t *r = new pa_value_t;
-    r->value.func = new pa_func_t(f);
+    r->value.func = new(UseGC) pa_func_t(f); // Traced, closures keep their environment in it.
     r->type = pa_function;
     return r;
 
 }
 
+// Closures compiled from Pa: a static function and its captured variables.
+template<typename E>
+struct pa_closure_t {
+    pa_value_t* (*fn)(E*, pa_list_t&, pa_dict_t&, pa_value_t*);
+    E* env;
+    pa_value_t* operator()(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) const {
+        return fn(env, args, kwargs, _this);
+    }
+};
+
+template<typename E>
+inline pa_value_t* pa_new_closure(pa_value_t* (*fn)(E*, pa_list_t&, pa_dict_t&, pa_value_t*), E* env) {
+    return pa_new_function(pa_closure_t<E>{fn, env});
+}
+
 inline pa_value_t* pa_new_class() {
     pa_value_t *r = new pa_value_t;
     r->value.cls = new pa_class_data;
@@ -243,26 +384,320 @@ inline pa_value_t* pa_new_object(pa_class_data* _class) {
     return r;
 }
 
-// Function invoke
+// Typed arrays
+//
+// Contiguous int64/float64 buffers. The kernels work on PA_SIMD_LANES
+// elements at a time through GCC/Clang vector types, which compile to AVX2
+// or SSE2 instructions depending on the target flags (-march=native picks
+// AVX2 where available, 4 lanes instead of 2) and to scalar code
+// elsewhere. The tail is done one element at a time.
+enum pa_array_kind_t {
+    pa_array_i64,
+    pa_array_f64
+};
 
-inline pa_value_t* pa_function_call(pa_value_t* func, pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
-    
-    if(func->type == pa_function) {
-        return (*(func->value.func))(args, kwargs, _this);
-    } else if(func->type == pa_class) {
-        pa_value_t* new_obj = pa_new_object(func->value.cls);
-        pa_value_t* ret = func->value.cls->get_operator("constructor");
-        if(ret) {
-            pa_function_call(ret, args, kwargs, new_obj); 
-        }
-        return new_obj;
+class pa_array_data : public gc {
+    public:
+        pa_array_kind_t kind;
+        size_t size;
+        union {
+            int64_t* i64;
+            double* f64;
+            void* ptr;
+        } data;
+};
+
+inline pa_value_t* pa_new_array(pa_array_kind_t kind, size_t size) {
+    pa_value_t *r = new pa_value_t;
+    r->value.arr = new pa_array_data;
+    r->value.arr->kind = kind;
+    r->value.arr->size = size;
+    r->value.arr->data.ptr = GC_MALLOC_ATOMIC(max(size, (size_t)1) * 8); // Nothing to trace in it
+    r->type = pa_array;
+    return r;
+}
+
+// Vectors are as wide as the target's registers: 32 bytes would change the
+// calling convention of every kernel on builds without -mavx.
+#ifndef PA_SIMD_LANES
+#ifdef __AVX__
+#define PA_SIMD_LANES 4
+#else
+#define PA_SIMD_LANES 2
+#endif
+#endif
+typedef double pa_vf64_t __attribute__((vector_size(PA_SIMD_LANES * 8)));
+typedef int64_t pa_vi64_t __attribute__((vector_size(PA_SIMD_LANES * 8)));
+
+template<typename V, typename T>
+inline V pa_simd_load(const T* p) {
+    V v;
+    memcpy(&v, p, sizeof(V));
+    return v;
+}
+
+template<typename V, typename T>
+inline void pa_simd_store(T* p, V v) {
+    memcpy(p, &v, sizeof(V));
+}
+
+template<typename V, typename T>
+inline V pa_simd_splat(T x) {
+    V v;
+    for(int i = 0; i < PA_SIMD_LANES; i++) v[i] = x;
+    return v;
+}
+
+// Elementwise operations, for scalars and vectors alike. Comparisons give 1 or 0.
+struct pa_simd_add { template<typename X> X operator()(X a, X b) const { return a + b; } };
+struct pa_simd_sub { template<typename X> X operator()(X a, X b) const { return a - b; } };
+struct pa_simd_mul { template<typename X> X operator()(X a, X b) const { return a * b; } };
+struct pa_simd_div { template<typename X> X operator()(X a, X b) const { return a / b; } };
+
+#define PA_SIMD_COMPARISON(name, op) \
+    struct name { \
+        template<typename X> int64_t operator()(X a, X b) const { return a op b; } \
+        pa_vi64_t operator()(pa_vf64_t a, pa_vf64_t b) const { return (pa_vi64_t)-(a op b); } \
+        pa_vi64_t operator()(pa_vi64_t a, pa_vi64_t b) const { return (pa_vi64_t)-(a op b); } \
+    };
+
+PA_SIMD_COMPARISON(pa_simd_eq, ==)
+PA_SIMD_COMPARISON(pa_simd_neq, !=)
+PA_SIMD_COMPARISON(pa_simd_lt, <)
+PA_SIMD_COMPARISON(pa_simd_lte, <=)
+PA_SIMD_COMPARISON(pa_simd_gt, >)
+PA_SIMD_COMPARISON(pa_simd_gte, >=)
+
+// r[i] = op(a[i], b[i]); an operand flagged as scalar is broadcast instead.
+template<typename V, typename T, typename R, typename Op>
+inline void pa_simd_map(R* r, const T* a, bool a_scalar, const T* b, bool b_scalar, size_t n, Op op) {
+    V va = pa_simd_splat<V>(*a);
+    V vb = pa_simd_splat<V>(*b);
+    size_t i = 0;
+    for(; i + PA_SIMD_LANES <= n; i += PA_SIMD_LANES) {
+        if(!a_scalar) va = pa_simd_load<V>(a + i);
+        if(!b_scalar) vb = pa_simd_load<V>(b + i);
+        pa_simd_store(r + i, op(va, vb));
+    }
+    for(; i < n; i++) {
+        r[i] = op(a[a_scalar ? 0 : i], b[b_scalar ? 0 : i]);
+    }
+}
+
+template<typename V, typename T>
+inline T pa_simd_sum(const T* a, size_t n) {
+    V acc = pa_simd_splat<V>((T)0);
+    size_t i = 0;
+    for(; i + PA_SIMD_LANES <= n; i += PA_SIMD_LANES) {
+        acc += pa_simd_load<V>(a + i);
+    }
+    T r = 0;
+    for(int k = 0; k < PA_SIMD_LANES; k++) r += acc[k];
+    for(; i < n; i++) r += a[i];
+    return r;
+}
+
+template<typename V, typename T>
+inline T pa_simd_dot(const T* a, const T* b, size_t n) {
+    V acc = pa_simd_splat<V>((T)0);
+    size_t i = 0;
+    for(; i + PA_SIMD_LANES <= n; i += PA_SIMD_LANES) {
+        acc += pa_simd_load<V>(a + i) * pa_simd_load<V>(b + i);
+    }
+    T r = 0;
+    for(int k = 0; k < PA_SIMD_LANES; k++) r += acc[k];
+    for(; i < n; i++) r += a[i] * b[i];
+    return r;
+}
+
+// Smallest (or largest) element of a non-empty buffer.
+template<typename V, typename T, bool Max>
+inline T pa_simd_extreme(const T* a, size_t n) {
+    V acc = pa_simd_splat<V>(a[0]);
+    size_t i = 0;
+    for(; i + PA_SIMD_LANES <= n; i += PA_SIMD_LANES) {
+        V x = pa_simd_load<V>(a + i);
+        pa_vi64_t take = (pa_vi64_t)(Max ? x > acc : x < acc);
+        acc = (V)((take & (pa_vi64_t)x) | (~take & (pa_vi64_t)acc));
+    }
+    T r = acc[0];
+    for(int k = 1; k < PA_SIMD_LANES; k++) {
+        if(Max ? acc[k] > r : acc[k] < r) r = acc[k];
+    }
+    for(; i < n; i++) {
+        if(Max ? a[i] > r : a[i] < r) r = a[i];
+    }
+    return r;
+}
+
+enum pa_array_op_t {
+    pa_array_add,
+    pa_array_sub,
+    pa_array_mul,
+    pa_array_div,
+    pa_array_eq,
+    pa_array_neq,
+    pa_array_lt,
+    pa_array_lte,
+    pa_array_gt,
+    pa_array_gte
+};
+
+template<typename V, typename T>
+inline void pa_array_kernel(pa_array_op_t op, void* r, const T* a, bool a_scalar, const T* b, bool b_scalar, size_t n) {
+    T* rt = (T*)r;
+    int64_t* ri = (int64_t*)r;
+    switch(op) {
+        case pa_array_add: pa_simd_map<V>(rt, a, a_scalar, b, b_scalar, n, pa_simd_add()); break;
+        case pa_array_sub: pa_simd_map<V>(rt, a, a_scalar, b, b_scalar, n, pa_simd_sub()); break;
+        case pa_array_mul: pa_simd_map<V>(rt, a, a_scalar, b, b_scalar, n, pa_simd_mul()); break;
+        case pa_array_div: pa_simd_map<V>(rt, a, a_scalar, b, b_scalar, n, pa_simd_div()); break;
+        case pa_array_eq: pa_simd_map<V>(ri, a, a_scalar, b, b_scalar, n, pa_simd_eq()); break;
+        case pa_array_neq: pa_simd_map<V>(ri, a, a_scalar, b, b_scalar, n, pa_simd_neq()); break;
+        case pa_array_lt: pa_simd_map<V>(ri, a, a_scalar, b, b_scalar, n, pa_simd_lt()); break;
+        case pa_array_lte: pa_simd_map<V>(ri, a, a_scalar, b, b_scalar, n, pa_simd_lte()); break;
+        case pa_array_gt: pa_simd_map<V>(ri, a, a_scalar, b, b_scalar, n, pa_simd_gt()); break;
+        case pa_array_gte: pa_simd_map<V>(ri, a, a_scalar, b, b_scalar, n, pa_simd_gte()); break;
+    }
+}
+
+// The elements as float64, converted into a new buffer for int64 arrays.
+inline double* pa_array_as_f64(pa_array_data* a) {
+    if(a->kind == pa_array_f64) {
+        return a->data.f64;
+    }
+    double* r = (double*)GC_MALLOC_ATOMIC(max(a->size, (size_t)1) * sizeof(double));
+    for(size_t i = 0; i < a->size; i++) r[i] = a->data.i64[i];
+    return r;
+}
+
+// Applies an operator to an array and an array or a number, in either order.
+// Mixed int/float operands are computed in float64; comparisons give an int64
+// array of 1s and 0s.
+inline pa_value_t* pa_array_binary(pa_array_op_t op, pa_value_t* a, pa_value_t* b, const char* name) {
+    pa_value_t* operands[2] = {a, b};
+    int64_t i64[2];
+    double f64[2];
+    const void* data[2];
+    bool scalar[2];
+    bool is_f64 = false;
+    size_t n = 0;
+    int arrays = 0;
+    pa_value_t* r;
+
+    for(int k = 0; k < 2; k++) {
+        switch(operands[k]->type) {
+            case pa_array:
+                if(arrays++ && operands[k]->value.arr->size != n) {
+                    throw pa_new_exception(_TypeMismatchException, pa_string_t(name) + ": arrays of different sizes");
+                }
+                n = operands[k]->value.arr->size;
+                is_f64 = is_f64 || operands[k]->value.arr->kind == pa_array_f64;
+                break;
+            case pa_integer:
+                break;
+            case pa_float:
+                is_f64 = true;
+                break;
+            default:
+                goto type_mismatch;
+        }
+    }
+    if(!arrays) {
+        goto type_mismatch;
+    }
+
+    for(int k = 0; k < 2; k++) {
+        pa_value_t* x = operands[k];
+        scalar[k] = x->type != pa_array;
+        if(x->type == pa_array) {
+            data[k] = is_f64 ? (const void*)pa_array_as_f64(x->value.arr) : (const void*)x->value.arr->data.i64;
+        } else if(x->type == pa_integer) {
+            i64[k] = x->value.i64;
+            f64[k] = x->value.i64;
+            data[k] = is_f64 ? (const void*)&f64[k] : (const void*)&i64[k];
+        } else {
+            f64[k] = x->value.f64;
+            data[k] = &f64[k];
+        }
+    }
+
+    r = pa_new_array(op >= pa_array_eq || !is_f64 ? pa_array_i64 : pa_array_f64, n);
+    if(is_f64) {
+        pa_array_kernel<pa_vf64_t>(op, r->value.arr->data.ptr, (const double*)data[0], scalar[0], (const double*)data[1], scalar[1], n);
     } else {
-        throw pa_new_exception(_NotCallableException, "non-callable type");
-    } 
+        if(op == pa_array_div) {
+            const int64_t* d = (const int64_t*)data[1];
+            for(size_t i = 0; i < (scalar[1] ? 1 : n); i++) {
+                if(d[i] == 0) throw pa_new_exception(_DivideByZeroException, name);
+            }
+        }
+        pa_array_kernel<pa_vi64_t>(op, r->value.arr->data.ptr, (const int64_t*)data[0], scalar[0], (const int64_t*)data[1], scalar[1], n);
+    }
+    return r;
+type_mismatch:
+    throw pa_new_exception(_TypeMismatchException, name);
+}
+
+// Function invoke
+
+// Calls in tail position return pa_tail_call(...) instead: the callee and
+// its arguments wait in a per-thread slot, and pa_function_call makes the
+// call from its own frame once the caller's frame is gone. Tail calls that
+// recurse through several functions therefore run in constant stack.
+struct pa_tail_call_t {
+    pa_value_t* func;
+    pa_list_t args;
+    pa_dict_t kwargs;
+    pa_value_t* _this;
+};
 
+inline pa_tail_call_t& pa_pending_tail_call() {
+    static thread_local pa_tail_call_t call;
+    return call;
 }
 
-pa_value_t* pa_get_argument(pa_list_t& args, pa_dict_t& kwargs, const size_t nth, const pa_string_t name, pa_value_t *def) {
+inline pa_value_t* pa_tail_marker() {
+    static pa_value_t marker;
+    return &marker;
+}
+
+inline pa_value_t* pa_tail_call(pa_value_t* func, pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_tail_call_t& call = pa_pending_tail_call();
+    call.func = func;
+    call.args = move(args);
+    call.kwargs = move(kwargs);
+    call._this = _this;
+    return pa_tail_marker();
+}
+
+inline pa_value_t* pa_function_call(pa_value_t* func, pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    for(;;) {
+        pa_value_t* r;
+        if(func->type == pa_function) {
+            r = (*(func->value.func))(move(args), move(kwargs), _this);
+        } else if(func->type == pa_class) {
+            pa_value_t* new_obj = pa_new_object(func->value.cls);
+            pa_value_t* ret = func->value.cls->get_operator(pa_op_constructor);
+            if(ret) {
+                pa_function_call(ret, move(args), move(kwargs), new_obj); 
+            }
+            return new_obj;
+        } else {
+            throw pa_new_exception(_NotCallableException, "non-callable type");
+        } 
+        if(r != pa_tail_marker()) {
+            return r;
+        }
+        pa_tail_call_t& call = pa_pending_tail_call();
+        func = call.func;
+        args = move(call.args);
+        kwargs = move(call.kwargs);
+        _this = call._this;
+    }
+}
+
+inline pa_value_t* pa_get_argument(pa_list_t& args, pa_dict_t& kwargs, const size_t nth, const pa_string_t name, pa_value_t *def) {
     if(kwargs.count(name)) {
         return kwargs[name];
     } else if(args.size() >= nth+1) {
@@ -279,6 +714,28 @@ pa_value_t* pa_get_argument(pa_list_t& args, pa_dict_t& kwargs, const size_t nth
 }
 
 // Operators
+//
+// Binary operators switch once on the pair of operand types, so the builtin
+// pairs are a single jump. Anything else falls back to the elementwise
+// array kernels or to the left operand's class table.
+#define PA_TYPE_COUNT (pa_sequence + 1)
+#define PA_TYPE_PAIR(a, b) ((a) * PA_TYPE_COUNT + (b))
+
+inline pa_value_t* pa_operator_fallback(pa_operator_id_t op, pa_value_t* a, pa_value_t* b, const char* name) {
+    pa_value_t* n;
+    if(a->type == pa_object && (n = a->value.obj->get_operator(op))) {
+        return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
+    }
+    throw pa_new_exception(_TypeMismatchException, name);
+}
+
+inline pa_value_t* pa_operator_fallback(pa_operator_id_t op, pa_array_op_t array_op, pa_value_t* a, pa_value_t* b, const char* name) {
+    if(a->type == pa_array || (b->type == pa_array && (a->type == pa_integer || a->type == pa_float))) {
+        return pa_array_binary(array_op, a, b, name);
+    }
+    return pa_operator_fallback(op, a, b, name);
+}
+
 inline pa_value_t* pa_operator_setitem(pa_value_t* a, pa_value_t* b, pa_value_t* c) {
     pa_list_t* l;
     pa_list_t::iterator it;
@@ -300,11 +757,28 @@ inline pa_value_t* pa_operator_setitem(pa_value_t* a, pa_value_t* b, pa_value_t*
                 default:
                    goto type_mismatch;
             }
+        case pa_array:
+            if(b->type != pa_integer) {
+                goto type_mismatch;
+            }
+            if(b->value.i64 < 0 || a->value.arr->size <= (size_t)b->value.i64) {
+                throw pa_new_exception(_OutOfIndexException, "array index out of range");
+            }
+            if(a->value.arr->kind == pa_array_i64 && c->type == pa_integer) {
+                a->value.arr->data.i64[b->value.i64] = c->value.i64;
+            } else if(a->value.arr->kind == pa_array_f64 && c->type == pa_integer) {
+                a->value.arr->data.f64[b->value.i64] = c->value.i64;
+            } else if(a->value.arr->kind == pa_array_f64 && c->type == pa_float) {
+                a->value.arr->data.f64[b->value.i64] = c->value.f64;
+            } else {
+                goto type_mismatch;
+            }
+            return c;
         case pa_dictionary:
             m = PV2MAP(a);
             return (*m)[pa_operator_hash(b)] = c;
         case pa_object:
-            n = a->value.obj->get_operator("setitem");
+            n = a->value.obj->get_operator(pa_op_setitem);
             if(n) {
                 return pa_function_call(n, pa_list_t{b, c}, pa_dict_t{}, a);
             } else {
@@ -350,11 +824,22 @@ inline pa_value_t* pa_operator_getitem(pa_value_t* a, pa_value_t* b) {
                 default:
                    goto type_mismatch;
             }
+        case pa_array:
+            if(b->type != pa_integer) {
+                goto type_mismatch;
+            }
+            if(b->value.i64 < 0 || a->value.arr->size <= (size_t)b->value.i64) {
+                throw pa_new_exception(_OutOfIndexException, "array index out of range");
+            }
+            if(a->value.arr->kind == pa_array_f64) {
+                return pa_new_float(a->value.arr->data.f64[b->value.i64]);
+            }
+            return pa_new_integer(a->value.arr->data.i64[b->value.i64]);
         case pa_dictionary:
             m = PV2MAP(a);
             return (*m)[pa_operator_hash(b)];
         case pa_object:
-            n = a->value.obj->get_operator("getitem");
+            n = a->value.obj->get_operator(pa_op_getitem);
             if(n) {
                 return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
             } else {
@@ -373,7 +858,7 @@ inline pa_value_t* pa_operator_setattr(pa_value_t* a, pa_string_t b, pa_value_t*
         case pa_object:
             ret = a->value.obj->get_member(b);
             if(!ret) {
-                ret = a->value.obj->get_class()->get_operator("setattr");
+                ret = a->value.obj->get_class()->get_operator(pa_op_setattr);
                 if(ret) {
                     ret = pa_function_call(ret, pa_list_t{a, pa_new_string(b), c}, pa_dict_t{}, a);
                     return ret;
@@ -393,7 +878,7 @@ inline pa_value_t* pa_operator_getattr(pa_value_t* a, pa_string_t b) {
         case pa_object:
             ret = a->value.obj->get_member(b);
             if(!ret) {
-                ret = a->value.obj->get_class()->get_operator("getattr");
+                ret = a->value.obj->get_class()->get_operator(pa_op_getattr);
                 if(ret) {
                     ret = pa_function_call(ret, pa_list_t{a, pa_new_string(b)}, pa_dict_t{}, a);
                 } else {
@@ -412,40 +897,243 @@ inline pa_value_t* pa_operator_add(pa_value_t* a, pa_value_t* b) {
     pa_value_t* n;
     pa_list_t *l1, *l2;
     pa_list_t::iterator it;
-    switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_integer(a->value.i64 + b->value.i64);
-                default:
-                    goto type_mismatch;
+    pa_string_t s;
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_integer(a->value.i64 + b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_float(a->value.i64 + b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_float(a->value.f64 + b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_float(a->value.f64 + b->value.f64);
+        case PA_TYPE_PAIR(pa_string, pa_string):
+            s = pa_string_t();
+            s.reserve(PV2STR(a)->size() + PV2STR(b)->size());
+            s.append(*PV2STR(a)).append(*PV2STR(b));
+            return pa_new_string(move(s));
+        case PA_TYPE_PAIR(pa_list, pa_list):
+            n = pa_new_list();
+            l2 = PV2LIST(n);
+            l1 = PV2LIST(a);
+            for(it = l1->begin(); it != l1->end(); ++it) {
+                l2->push_back(*it);
             }
-        case pa_string:
-            switch(b->type) {
-                case pa_string:
-                    return pa_new_string(*PV2STR(a) + *PV2STR(b));
-                default:
-                   goto type_mismatch;
+            l1 = PV2LIST(b);
+            for(it = l1->begin(); it != l1->end(); ++it) {
+                l2->push_back(*it);
+            }
+            return n;
+        default:
+            return pa_operator_fallback(pa_op_add, pa_array_add, a, b, "+");
+    }
+}
+
+// a += b. A list grows in place, as every name bound to it expects; other
+// values are rebound to a + b.
+inline pa_value_t* pa_operator_add_assign(pa_value_t* a, pa_value_t* b) {
+    if(a->type == pa_list && b->type == pa_list) {
+        pa_list_t* l = PV2LIST(a);
+        if(a == b) {
+            pa_list_t copy(*l);
+            l->splice(l->end(), copy);
+        } else {
+            l->insert(l->end(), PV2LIST(b)->begin(), PV2LIST(b)->end());
+        }
+        return a;
+    }
+    return pa_operator_add(a, b);
+}
+
+inline pa_value_t* pa_operator_subtract(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_integer(a->value.i64 - b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_float(a->value.i64 - b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_float(a->value.f64 - b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_float(a->value.f64 - b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_subtract, pa_array_sub, a, b, "-");
+    }
+}
+
+inline pa_value_t* pa_operator_multiply(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_integer(a->value.i64 * b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_float(a->value.i64 * b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_float(a->value.f64 * b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_float(a->value.f64 * b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_multiply, pa_array_mul, a, b, "*");
+    }
+}
+
+inline pa_value_t* pa_operator_divide(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            if(b->value.i64 == 0) {
+                throw pa_new_exception(_DivideByZeroException, "/");
+            }
+            return pa_new_integer(a->value.i64 / b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_float(a->value.i64 / b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_float(a->value.f64 / b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_float(a->value.f64 / b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_divide, pa_array_div, a, b, "/");
+    }
+}
+
+inline pa_value_t* pa_operator_modulo(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            if(b->value.i64 == 0) {
+                throw pa_new_exception(_DivideByZeroException, "mod");
             }
+            return pa_new_integer(a->value.i64 % b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_float(fmod(a->value.i64, b->value.f64));
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_float(fmod(a->value.f64, b->value.i64));
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_float(fmod(a->value.f64, b->value.f64));
+        default:
+            return pa_operator_fallback(pa_op_modulo, a, b, "mod");
+    }
+}
+
+
+inline pa_value_t* pa_operator_eq(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_boolean(a->value.i64 == b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_boolean(a->value.i64 == b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_boolean(a->value.f64 == b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_boolean(a->value.f64 == b->value.f64);
+        case PA_TYPE_PAIR(pa_string, pa_string):
+            return pa_new_boolean((*PV2STR(a)) == (*PV2STR(b)));
+        default:
+            return pa_operator_fallback(pa_op_eq, pa_array_eq, a, b, "==");
+    }
+}
+
+inline pa_value_t* pa_operator_neq(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_integer(a->value.i64 != b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_boolean(a->value.i64 != b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_boolean(a->value.f64 != b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_boolean(a->value.f64 != b->value.f64);
+        case PA_TYPE_PAIR(pa_string, pa_string):
+            return pa_new_boolean((*PV2STR(a)) != (*PV2STR(b)));
+        default:
+            return pa_operator_fallback(pa_op_neq, pa_array_neq, a, b, "!=");
+    }
+}
+
+inline pa_value_t* pa_operator_gt(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_boolean(a->value.i64 > b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_boolean(a->value.i64 > b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_boolean(a->value.f64 > b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_boolean(a->value.f64 > b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_gt, pa_array_gt, a, b, ">");
+    }
+}
+
+inline pa_value_t* pa_operator_gte(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_boolean(a->value.i64 >= b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_boolean(a->value.i64 >= b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_boolean(a->value.f64 >= b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_boolean(a->value.f64 >= b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_gte, pa_array_gte, a, b, ">=");
+    }
+}
+
+inline pa_value_t* pa_operator_lt(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_boolean(a->value.i64 < b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_boolean(a->value.i64 < b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_boolean(a->value.f64 < b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_boolean(a->value.f64 < b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_lt, pa_array_lt, a, b, "<");
+    }
+}
+
+inline pa_value_t* pa_operator_lte(pa_value_t* a, pa_value_t* b) {
+    switch(PA_TYPE_PAIR(a->type, b->type)) {
+        case PA_TYPE_PAIR(pa_integer, pa_integer):
+            return pa_new_boolean(a->value.i64 <= b->value.i64);
+        case PA_TYPE_PAIR(pa_integer, pa_float):
+            return pa_new_boolean(a->value.i64 <= b->value.f64);
+        case PA_TYPE_PAIR(pa_float, pa_integer):
+            return pa_new_boolean(a->value.f64 <= b->value.i64);
+        case PA_TYPE_PAIR(pa_float, pa_float):
+            return pa_new_boolean(a->value.f64 <= b->value.f64);
+        default:
+            return pa_operator_fallback(pa_op_lte, pa_array_lte, a, b, "<=");
+    }
+}
+
+inline pa_value_t* pa_sequence_right(pa_value_t* a, pa_value_t* b);
+
+inline pa_value_t* pa_operator_right(pa_value_t* a, pa_value_t* b) {
+    // Flow operator (right).
+    pa_value_t* n;
+    pa_list_t *l1, *l2;
+    pa_list_t::iterator it;
+    switch(a->type) {
         case pa_list:
             switch(b->type) {
-                case pa_list:
+                case pa_function:
+                    // map(list->list) with a func
                     n = pa_new_list();
-                    l2 = PV2LIST(n);
                     l1 = PV2LIST(a);
-                    for(it = l1->begin(); it != l1->end(); ++it) {
-                        l2->push_back(*it);
-                    }
-                    l1 = PV2LIST(b);
-                    for(it = l1->begin(); it != l1->end(); ++it) {
-                        l2->push_back(*it);
+                    l2 = PV2LIST(n);
+                    for(it = l1->begin(); it != l1->end(); ++it){
+                        l2->push_back(pa_function_call(b, pa_list_t{*it}, pa_dict_t{}, a));
                     }
                     return n;
+                case pa_sequence:
+                    return pa_sequence_right(a, b);
                 default:
-                   goto type_mismatch;
+                    goto type_mismatch;
             }
+        case pa_sequence:
+            return pa_sequence_right(a, b);
         case pa_object:
-            n = a->value.obj->get_operator("+");
+            n = a->value.obj->get_operator(pa_op_right);
             if(n) {
                 return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
             } else {
@@ -455,21 +1143,163 @@ inline pa_value_t* pa_operator_add(pa_value_t* a, pa_value_t* b) {
             goto type_mismatch; 
     }
 type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "+");
+    throw pa_new_exception(_TypeMismatchException, "->");
+}
+
+// Parallel map
+//
+// `list ->> func` calls func on a pool of worker threads, $PA_THREADS or one
+// per core including the caller. The list is cut into chunks that the
+// workers and the calling thread claim one at a time, so a `->>` nested in
+// another never waits on a busy pool. Results keep the input order, and the
+// exception raised is the one a sequential `->` would have raised.
+#define pa_task_t function<void()>
+
+class pa_thread_pool_t {
+    private:
+        deque<pa_task_t, traceable_allocator<pa_task_t>> tasks;
+        mutex lock;
+        condition_variable ready;
+        size_t workers;
+        void work() {
+            struct GC_stack_base sb;
+            GC_get_stack_base(&sb);
+            GC_register_my_thread(&sb);
+            for(;;) {
+                pa_task_t task;
+                {
+                    unique_lock<mutex> l(this->lock);
+                    this->ready.wait(l, [this] { return !this->tasks.empty(); });
+                    task = this->tasks.front();
+                    this->tasks.pop_front();
+                }
+                task();
+            }
+        }
+    public:
+        pa_thread_pool_t(size_t workers) : workers(workers) {
+            GC_allow_register_threads();
+            for(size_t i = 0; i < workers; i++) {
+                thread(&pa_thread_pool_t::work, this).detach();
+            }
+        }
+        size_t size() { return this->workers; }
+        void submit(pa_task_t task) {
+            {
+                lock_guard<mutex> l(this->lock);
+                this->tasks.push_back(task);
+            }
+            this->ready.notify_one();
+        }
+};
+
+inline size_t pa_thread_count() {
+    const char* env = getenv("PA_THREADS");
+    long n = env ? atol(env) : (long)thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+inline pa_thread_pool_t& pa_thread_pool() {
+    static pa_thread_pool_t* pool = new pa_thread_pool_t(pa_thread_count() - 1);
+    return *pool;
+}
+
+class pa_parallel_map_t : public gc {
+    public:
+        pa_value_t* func;
+        pa_value_t* _this;
+        pa_value_t** input;
+        pa_value_t** output;
+        size_t size;
+        size_t chunk;
+        size_t chunks;
+        size_t done;
+        atomic<size_t> next;
+        atomic<size_t> failed_at;
+        pa_value_t* error;
+        exception_ptr native_error;
+        mutex lock;
+        condition_variable finished;
+
+        pa_parallel_map_t(pa_value_t* func, pa_value_t* _this, size_t size, size_t chunk)
+            : func(func), _this(_this), size(size), chunk(chunk), chunks((size + chunk - 1) / chunk),
+              done(0), next(0), failed_at(size), error(NULL) {
+            this->input = (pa_value_t**)GC_MALLOC(size * sizeof(pa_value_t*));
+            this->output = (pa_value_t**)GC_MALLOC(size * sizeof(pa_value_t*));
+        }
+        void fail(size_t i, pa_value_t* error, exception_ptr native_error) {
+            lock_guard<mutex> l(this->lock);
+            if(i < this->failed_at) {
+                this->failed_at = i;
+                this->error = error;
+                this->native_error = native_error;
+            }
+        }
+        // Claims chunks until there are none left.
+        void run() {
+            for(size_t c = this->next++; c < this->chunks; c = this->next++) {
+                size_t end = min((c + 1) * this->chunk, this->size);
+                for(size_t i = c * this->chunk; i < end && i < this->failed_at; i++) {
+                    try {
+                        this->output[i] = pa_function_call(this->func, pa_list_t{this->input[i]}, pa_dict_t{}, this->_this);
+                    } catch(pa_value_t* e) {
+                        this->fail(i, e, exception_ptr());
+                    } catch(...) {
+                        this->fail(i, NULL, current_exception());
+                    }
+                }
+                lock_guard<mutex> l(this->lock);
+                if(++this->done == this->chunks) {
+                    this->finished.notify_all();
+                }
+            }
+        }
+        void wait() {
+            unique_lock<mutex> l(this->lock);
+            this->finished.wait(l, [this] { return this->done == this->chunks; });
+        }
+};
+
+inline pa_value_t* pa_parallel_map(pa_value_t* a, pa_value_t* f) {
+    pa_list_t* l = PV2LIST(a);
+    pa_thread_pool_t& pool = pa_thread_pool();
+    if(pool.size() == 0 || l->size() < 2) {
+        return pa_operator_right(a, f);
+    }
+
+    // A few chunks per thread evens out calls of uneven cost.
+    size_t threads = pool.size() + 1;
+    pa_parallel_map_t* m = new pa_parallel_map_t(f, a, l->size(), max(l->size() / (threads * 8), (size_t)1));
+    copy(l->begin(), l->end(), m->input);
+    for(size_t i = 0; i < min(pool.size(), m->chunks - 1); i++) {
+        pool.submit([m] { m->run(); });
+    }
+    m->run();
+    m->wait();
+
+    if(m->failed_at < m->size) {
+        if(m->error) {
+            throw m->error;
+        }
+        rethrow_exception(m->native_error);
+    }
+    pa_value_t* n = pa_new_list();
+    PV2LIST(n)->assign(m->output, m->output + m->size);
+    return n;
 }
 
-inline pa_value_t* pa_operator_subtract(pa_value_t *a, pa_value_t *b) {
+inline pa_value_t* pa_operator_parallel_right(pa_value_t* a, pa_value_t* b) {
     pa_value_t* n;
     switch(a->type) {
-        case pa_integer:
+        case pa_list:
             switch(b->type) {
-                case pa_integer:
-                    return pa_new_integer(a->value.i64 - b->value.i64);
+                case pa_function:
+                    return pa_parallel_map(a, b);
                 default:
                     goto type_mismatch;
             }
         case pa_object:
-            n = a->value.obj->get_operator("-");
+            n = a->value.obj->get_operator(pa_op_parallel_right);
             if(n) {
                 return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
             } else {
@@ -479,132 +1309,200 @@ inline pa_value_t* pa_operator_subtract(pa_value_t *a, pa_value_t *b) {
             goto type_mismatch; 
     }
 type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "-");
+    throw pa_new_exception(_TypeMismatchException, "->>");
 }
 
-inline pa_value_t* pa_operator_multiply(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_integer(a->value.i64 * b->value.i64);
-                default:
-                    goto type_mismatch;
-            }
-        case pa_object:
-            n = a->value.obj->get_operator("*");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+// Tasks
+//
+// `spawn expr` evaluates expr on a work-stealing scheduler and gives a
+// future; `await future` returns its value or rethrows its exception. Every
+// worker owns a deque: it pushes and pops its own tasks at the back and
+// steals from the front of the others. Slot 0 is shared by the threads that
+// are not workers (the main thread among them). A thread waiting in `await`
+// runs queued tasks while there are any, so tasks can await each other;
+// when there are none it sleeps like an idle worker until the future is
+// done or a task is queued.
+class pa_future_data : public gc {
+    public:
+        pa_value_t* func;
+        pa_value_t* value;
+        pa_value_t* error;
+        exception_ptr native_error;
+        atomic<bool> done;
+        atomic<int> waiters;
+
+        pa_future_data(pa_value_t* func) : func(func), value(NULL), error(NULL), done(false), waiters(0) {}
+        void run() {
+            try {
+                this->value = pa_function_call(this->func, pa_list_t{}, pa_dict_t{}, pa_new_nil());
+            } catch(pa_value_t* e) {
+                this->error = e;
+            } catch(...) {
+                this->native_error = current_exception();
             }
-        default:
-            goto type_mismatch; 
-    }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "*");
+            this->func = NULL;
+            this->done.store(true);
+        }
+};
+
+class pa_task_deque_t {
+    private:
+        mutex lock;
+        deque<pa_future_data*, traceable_allocator<pa_future_data*>> tasks;
+    public:
+        void push(pa_future_data* t) {
+            lock_guard<mutex> l(this->lock);
+            this->tasks.push_back(t);
+        }
+        pa_future_data* pop() {
+            lock_guard<mutex> l(this->lock);
+            if(this->tasks.empty()) return NULL;
+            pa_future_data* t = this->tasks.back();
+            this->tasks.pop_back();
+            return t;
+        }
+        pa_future_data* steal() {
+            lock_guard<mutex> l(this->lock);
+            if(this->tasks.empty()) return NULL;
+            pa_future_data* t = this->tasks.front();
+            this->tasks.pop_front();
+            return t;
+        }
+};
+
+inline size_t& pa_worker_slot() {
+    static thread_local size_t slot = 0;
+    return slot;
 }
 
-inline pa_value_t* pa_operator_divide(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_integer(a->value.i64 / b->value.i64);
-                default:
-                    goto type_mismatch;
+class pa_scheduler_t {
+    private:
+        pa_task_deque_t* deques;
+        size_t slots;
+        atomic<size_t> queued;
+        atomic<size_t> sleepers;
+        mutex sleep_lock;
+        condition_variable wake;
+        void work(size_t slot) {
+            struct GC_stack_base sb;
+            GC_get_stack_base(&sb);
+            GC_register_my_thread(&sb);
+            pa_worker_slot() = slot;
+            for(int idle = 0;; idle++) {
+                pa_future_data* t = this->find(slot);
+                if(t) {
+                    this->run(t);
+                    idle = 0;
+                } else if(idle < 64) {
+                    this_thread::yield();
+                } else {
+                    unique_lock<mutex> l(this->sleep_lock);
+                    this->sleepers++;
+                    this->wake.wait(l, [this] { return this->queued > 0; });
+                    this->sleepers--;
+                }
             }
-        case pa_object:
-            n = a->value.obj->get_operator("/");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+        }
+    public:
+        pa_scheduler_t(size_t slots) : deques(new pa_task_deque_t[slots]), slots(slots), queued(0), sleepers(0) {
+            GC_allow_register_threads();
+            for(size_t i = 1; i < slots; i++) {
+                thread(&pa_scheduler_t::work, this, i).detach();
             }
-        default:
-            goto type_mismatch; 
-    }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "/");
-}
-
-inline pa_value_t* pa_operator_modulo(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_integer(a->value.i64 % b->value.i64);
-                default:
-                    goto type_mismatch;
+        }
+        void push(pa_future_data* t) {
+            this->deques[pa_worker_slot()].push(t);
+            this->queued++;
+            if(this->sleepers > 0) {
+                lock_guard<mutex> l(this->sleep_lock);
+                this->wake.notify_one();
             }
-        case pa_object:
-            n = a->value.obj->get_operator("mod");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+        }
+        // The newest task of the given slot, or else the oldest of another.
+        pa_future_data* find(size_t slot) {
+            pa_future_data* t = this->deques[slot].pop();
+            for(size_t i = 1; !t && i < this->slots; i++) {
+                t = this->deques[(slot + i) % this->slots].steal();
             }
-        default:
-            goto type_mismatch; 
-    }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "mod");
+            if(t) {
+                this->queued--;
+            }
+            return t;
+        }
+        void run(pa_future_data* t) {
+            t->run();
+            if(t->waiters > 0) {
+                lock_guard<mutex> l(this->sleep_lock);
+                this->wake.notify_all();
+            }
+        }
+        // Sleeps until f is done or a task is queued.
+        void wait(pa_future_data* f) {
+            unique_lock<mutex> l(this->sleep_lock);
+            f->waiters++;
+            this->sleepers++;
+            this->wake.wait(l, [this, f] { return f->done || this->queued > 0; });
+            this->sleepers--;
+            f->waiters--;
+        }
+};
+
+inline pa_scheduler_t& pa_scheduler() {
+    static pa_scheduler_t* scheduler = new pa_scheduler_t(pa_thread_count());
+    return *scheduler;
 }
 
+inline pa_value_t* pa_spawn(pa_value_t* func) {
+    pa_value_t *r = new pa_value_t;
+    r->value.future = new pa_future_data(func);
+    r->type = pa_future;
+    pa_scheduler().push(r->value.future);
+    return r;
+}
 
-inline pa_value_t* pa_operator_eq(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
+inline pa_value_t* pa_await(pa_value_t* a) {
+    pa_future_data* f;
     switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_boolean(a->value.i64 == b->value.i64);
-                default:
-                    goto type_mismatch;
+        case pa_future:
+            f = a->value.future;
+            for(int idle = 0; !f->done.load(memory_order_acquire); idle++) {
+                pa_future_data* t = pa_scheduler().find(pa_worker_slot());
+                if(t) {
+                    pa_scheduler().run(t);
+                    idle = 0;
+                } else if(idle < 64) {
+                    this_thread::yield();
+                } else {
+                    pa_scheduler().wait(f);
+                }
             }
-        case pa_string:
-            switch(b->type) {
-                case pa_string:
-                    return pa_new_boolean((*PV2STR(a)) == (*PV2STR(b)));
-                default:
-                    goto type_mismatch;
+            if(f->error) {
+                throw f->error;
             }
-        case pa_object:
-            n = a->value.obj->get_operator("==");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+            if(f->native_error) {
+                rethrow_exception(f->native_error);
             }
+            return f->value;
         default:
-            goto type_mismatch; 
+            goto type_mismatch;
     }
 type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "==");
+    throw pa_new_exception(_TypeMismatchException, "await");
 }
 
-inline pa_value_t* pa_operator_neq(pa_value_t* a, pa_value_t* b) {
+
+inline pa_value_t* pa_operator_or(pa_value_t* a, pa_value_t* b) {
     pa_value_t* n;
     switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_integer(a->value.i64 != b->value.i64);
-                default:
-                    goto type_mismatch;
-            }
-        case pa_string:
+        case pa_boolean:
             switch(b->type) {
-                case pa_string:
-                    return pa_new_boolean((*PV2STR(a)) != (*PV2STR(b)));
+                case pa_boolean:
+                    return pa_new_boolean(a->value.b || b->value.b);
                 default:
                     goto type_mismatch;
             }
         case pa_object:
-            n = a->value.obj->get_operator("!=");
+            n = a->value.obj->get_operator(pa_op_or);
             if(n) {
                 return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
             } else {
@@ -614,21 +1512,21 @@ inline pa_value_t* pa_operator_neq(pa_value_t* a, pa_value_t* b) {
             goto type_mismatch; 
     }
 type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "!=");
+    throw pa_new_exception(_TypeMismatchException, "or");
 }
 
-inline pa_value_t* pa_operator_gt(pa_value_t* a, pa_value_t* b) {
+inline pa_value_t* pa_operator_and(pa_value_t* a, pa_value_t* b) {
     pa_value_t* n;
     switch(a->type) {
-        case pa_integer:
+        case pa_boolean:
             switch(b->type) {
-                case pa_integer:
-                    return pa_new_boolean(a->value.i64 > b->value.i64);
+                case pa_boolean:
+                    return pa_new_boolean(a->value.b && b->value.b);
                 default:
                     goto type_mismatch;
             }
         case pa_object:
-            n = a->value.obj->get_operator(">");
+            n = a->value.obj->get_operator(pa_op_and);
             if(n) {
                 return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
             } else {
@@ -638,201 +1536,782 @@ inline pa_value_t* pa_operator_gt(pa_value_t* a, pa_value_t* b) {
             goto type_mismatch; 
     }
 type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, ">");
+    throw pa_new_exception(_TypeMismatchException, "and");
 }
 
-inline pa_value_t* pa_operator_gte(pa_value_t* a, pa_value_t* b) {
+inline pa_value_t* pa_operator_length(pa_value_t* a) {
     pa_value_t* n;
+    pa_list_t* l;
+    pa_string_t* s;
     switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_boolean(a->value.i64 >= b->value.i64);
-                default:
-                    goto type_mismatch;
-            }
+        case pa_list:
+            l = PV2LIST(a);
+            return pa_new_integer(l->size());
+        case pa_string:
+            s = PV2STR(a);
+            return pa_new_integer(s->length());
+        case pa_array:
+            return pa_new_integer(a->value.arr->size);
         case pa_object:
-            n = a->value.obj->get_operator(">=");
+            n = a->value.obj->get_operator(pa_op_length);
             if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
+                return pa_function_call(n, pa_list_t{}, pa_dict_t{}, a);
             } else {
                 goto type_mismatch;
             }
         default:
             goto type_mismatch; 
     }
+
 type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, ">=");
+    throw pa_new_exception(_TypeMismatchException, "length");
 }
 
-inline pa_value_t* pa_operator_lt(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_boolean(a->value.i64 < b->value.i64);
-                default:
-                    goto type_mismatch;
-            }
-        case pa_object:
-            n = a->value.obj->get_operator("<");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+// len(x) hoisted out of a loop that does not assign x (pypac -O2). Strings
+// and arrays cannot change length; anything else is measured every time.
+inline pa_value_t* pa_length_if_fixed(pa_value_t* a) {
+    return a->type == pa_string || a->type == pa_array ? pa_operator_length(a) : NULL;
+}
+
+inline pa_value_t* pa_length_cached(pa_value_t* length, pa_value_t* a) {
+    return length ? length : pa_operator_length(a);
+}
+
+inline bool pa_instanceof(pa_value_t* o, pa_value_t* cls) {
+    return o->value.obj->get_class() == cls->value.cls;
+}
+
+// Profiling
+//
+// Builds with -DPA_PROFILE (`pypac --profile`) open a scope in every Pa
+// function. Each thread keeps a call tree with the calls and the time spent
+// under every node. At exit the trees are summed per function into a report
+// on stderr, and written as folded stacks (`caller;callee microseconds`
+// lines, the input of flamegraph.pl) to $PA_PROFILE_OUT, or
+// pa-profile.folded by default.
+#ifdef PA_PROFILE
+#include <time.h>
+#include <vector>
+
+class pa_profile_site_t {
+    public:
+        const char* name;
+        const char* file;
+        int line;
+        pa_profile_site_t(const char* name, const char* file, int line) : name(name), file(file), line(line) {}
+};
+
+class pa_profile_node_t {
+    public:
+        pa_profile_site_t* site;
+        pa_profile_node_t* parent;
+        map<pa_profile_site_t*, pa_profile_node_t*> children;
+        uint64_t calls;
+        uint64_t total_ns;
+        uint64_t children_ns;
+        pa_profile_node_t(pa_profile_site_t* site, pa_profile_node_t* parent)
+            : site(site), parent(parent), calls(0), total_ns(0), children_ns(0) {}
+};
+
+inline uint64_t pa_profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline void pa_profile_dump();
+
+inline vector<pa_profile_node_t*>& pa_profile_roots() {
+    static vector<pa_profile_node_t*> roots;
+    static int registered = atexit(pa_profile_dump);
+    return roots;
+}
+
+inline mutex& pa_profile_lock() {
+    static mutex lock;
+    return lock;
+}
+
+inline pa_profile_node_t*& pa_profile_current() {
+    static thread_local pa_profile_node_t* current = NULL;
+    if(!current) {
+        current = new pa_profile_node_t(NULL, NULL);
+        lock_guard<mutex> l(pa_profile_lock());
+        pa_profile_roots().push_back(current);
+    }
+    return current;
+}
+
+class pa_profile_scope_t {
+    private:
+        pa_profile_node_t* node;
+        uint64_t start;
+    public:
+        pa_profile_scope_t(pa_profile_site_t* site) {
+            pa_profile_node_t*& current = pa_profile_current();
+            pa_profile_node_t*& child = current->children[site];
+            if(!child) {
+                child = new pa_profile_node_t(site, current);
             }
-        default:
-            goto type_mismatch; 
+            this->node = child;
+            current = child;
+            child->calls++;
+            this->start = pa_profile_now();
+        }
+        ~pa_profile_scope_t() {
+            uint64_t elapsed = pa_profile_now() - this->start;
+            this->node->total_ns += elapsed;
+            this->node->parent->children_ns += elapsed;
+            pa_profile_current() = this->node->parent;
+        }
+};
+
+class pa_profile_entry_t {
+    public:
+        pa_profile_site_t* site;
+        uint64_t calls;
+        uint64_t inclusive_ns;
+        uint64_t exclusive_ns;
+};
+
+// Folded stacks keep at most this many frames; deeper calls are counted
+// under the last frame that fits.
+#ifndef PA_PROFILE_MAX_FRAMES
+#define PA_PROFILE_MAX_FRAMES 256
+#endif
+
+class pa_profile_walk_t {
+    public:
+        pa_profile_node_t* node;
+        map<pa_profile_site_t*, pa_profile_node_t*>::iterator next;
+        size_t prefix; // Length of the folded stack up to and including node
+        int frames;
+};
+
+// Sums a call tree per function and writes its folded stacks to fp as the
+// walk reaches them. A directly recursive call adds no frame to the stack,
+// and the nodes that end up with the stack of the line before are added to
+// it; flamegraph.pl adds up the equal stacks that are left. Time under a
+// recursive call counts once towards the inclusive time of the function.
+inline void pa_profile_collect(pa_profile_node_t* root, FILE* fp, map<pa_profile_site_t*, pa_profile_entry_t>& entries) {
+    map<pa_profile_site_t*, int> active;
+    vector<pa_profile_walk_t> stack;
+    string folded, line;
+    uint64_t line_us = 0;
+    pa_profile_walk_t top = {root, root->children.begin(), 0, 0};
+    stack.push_back(top);
+    while(!stack.empty()) {
+        pa_profile_walk_t& w = stack.back();
+        if(w.next == w.node->children.end()) {
+            if(w.node->site) active[w.node->site]--;
+            stack.pop_back();
+            continue;
+        }
+        pa_profile_node_t* child = (w.next++)->second;
+        folded.resize(w.prefix);
+        pa_profile_walk_t down = {child, child->children.begin(), w.prefix, w.frames};
+        if(child->site != w.node->site && w.frames < PA_PROFILE_MAX_FRAMES) {
+            char frame[512];
+            snprintf(frame, sizeof(frame), "%s%s (%s:%d)", w.frames ? ";" : "", child->site->name, child->site->file, child->site->line);
+            folded += frame;
+            down.prefix = folded.size();
+            down.frames++;
+        }
+
+        pa_profile_entry_t& e = entries[child->site];
+        uint64_t exclusive = child->total_ns > child->children_ns ? child->total_ns - child->children_ns : 0;
+        e.site = child->site;
+        e.calls += child->calls;
+        e.exclusive_ns += exclusive;
+        if(!active[child->site]++) {
+            e.inclusive_ns += child->total_ns;
+        }
+        if(fp && folded != line) {
+            if(line_us) fprintf(fp, "%s %llu\n", line.c_str(), (unsigned long long)line_us);
+            line = folded;
+            line_us = 0;
+        }
+        line_us += exclusive / 1000;
+        stack.push_back(down);
     }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "<");
+    if(fp && line_us) fprintf(fp, "%s %llu\n", line.c_str(), (unsigned long long)line_us);
 }
 
-inline pa_value_t* pa_operator_lte(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_integer:
-            switch(b->type) {
-                case pa_integer:
-                    return pa_new_boolean(a->value.i64 <= b->value.i64);
-                default:
-                    goto type_mismatch;
+inline bool pa_profile_by_exclusive(const pa_profile_entry_t& a, const pa_profile_entry_t& b) {
+    return a.exclusive_ns > b.exclusive_ns;
+}
+
+inline void pa_profile_dump() {
+    map<pa_profile_site_t*, pa_profile_entry_t> entries;
+    const char* path = getenv("PA_PROFILE_OUT");
+    path = path ? path : "pa-profile.folded";
+    FILE* fp = fopen(path, "w");
+    {
+        lock_guard<mutex> l(pa_profile_lock());
+        for(size_t i = 0; i < pa_profile_roots().size(); i++) {
+            pa_profile_collect(pa_profile_roots()[i], fp, entries);
+        }
+    }
+    if(fp) fclose(fp);
+
+    vector<pa_profile_entry_t> report;
+    for(map<pa_profile_site_t*, pa_profile_entry_t>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        report.push_back(it->second);
+    }
+    sort(report.begin(), report.end(), pa_profile_by_exclusive);
+    fflush(stdout);
+    fprintf(stderr, "\n%12s %14s %14s  %s (folded stacks: %s)\n", "calls", "inclusive ms", "exclusive ms", "function", path);
+    for(size_t i = 0; i < report.size(); i++) {
+        fprintf(stderr, "%12llu %14.3f %14.3f  %s (%s:%d)\n", (unsigned long long)report[i].calls,
+                report[i].inclusive_ns / 1e6, report[i].exclusive_ns / 1e6,
+                report[i].site->name, report[i].site->file, report[i].site->line);
+    }
+}
+
+#define PA_PROFILE_SCOPE(name, file, line) \
+    static pa_profile_site_t _pa_profile_site(name, file, line); \
+    pa_profile_scope_t _pa_profile_scope(&_pa_profile_site)
+#else
+#define PA_PROFILE_SCOPE(name, file, line)
+#endif
+
+// Lazy sequences
+//
+// A sequence hands out its items one at a time and is walked once:
+// generators (functions with `yield`), lazy(list), file.lines and
+// tcp.chunks. `->` on a sequence adds a stage to a pipeline instead of
+// building a list, and the map, filter(f) and take(n) stages of a chain
+// run in one loop per item, so nothing between the source and the
+// consumer is held in full. Stages without a source (`filter(f) -> g`)
+// wait for one; reduce(f, initial) ends a chain and runs it. A list with
+// stages applied gives a list back.
+class pa_sequence_data : public gc {
+    public:
+        virtual ~pa_sequence_data() {}
+        // The next item in v, or false at the end.
+        virtual bool next(pa_value_t*& v) = 0;
+};
+
+inline pa_value_t* pa_new_sequence(pa_sequence_data* s) {
+    pa_value_t *r = new pa_value_t;
+    r->value.seq = s;
+    r->type = pa_sequence;
+    return r;
+}
+
+class pa_list_sequence_t : public pa_sequence_data {
+    public:
+        pa_value_t* source;
+        pa_list_t::iterator it;
+        pa_list_sequence_t(pa_value_t* source) : source(source), it(PV2LIST(source)->begin()) {}
+        bool next(pa_value_t*& v) {
+            if(this->it == PV2LIST(this->source)->end()) {
+                return false;
             }
-        case pa_object:
-            n = a->value.obj->get_operator("<=");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+            v = *this->it++;
+            return true;
+        }
+};
+
+enum pa_stage_kind_t {
+    pa_stage_map,
+    pa_stage_filter,
+    pa_stage_take,
+    pa_stage_reduce
+};
+
+struct pa_stage_t {
+    pa_stage_kind_t kind;
+    pa_value_t* func;
+    pa_value_t* initial; // reduce
+    int64_t count;       // take: items still to let through
+};
+
+class pa_pipeline_t : public pa_sequence_data {
+    public:
+        pa_sequence_data* source; // NULL while the stages wait for one
+        pa_stage_t* stages;
+        size_t size;
+        bool exhausted;
+        pa_value_t* _this;
+
+        pa_pipeline_t(pa_sequence_data* source, size_t size)
+            : source(source), stages((pa_stage_t*)GC_MALLOC(max(size, (size_t)1) * sizeof(pa_stage_t))), size(size),
+              exhausted(false), _this(pa_new_nil()) {}
+        bool next(pa_value_t*& v) {
+            pa_value_t* x;
+            if(!this->source) {
+                throw pa_new_exception(_TypeMismatchException, "stages without a source");
+        }
+        next_item:
+            if(this->exhausted || !this->source->next(x)) {
+                return false;
             }
-        default:
-            goto type_mismatch; 
+            for(size_t i = 0; i < this->size; i++) {
+                pa_stage_t& s = this->stages[i];
+                switch(s.kind) {
+                    case pa_stage_map:
+                        x = pa_function_call(s.func, pa_list_t{x}, pa_dict_t{}, this->_this);
+                        break;
+                    case pa_stage_filter:
+                        if(!pa_evaluate_into_boolean(pa_function_call(s.func, pa_list_t{x}, pa_dict_t{}, this->_this))) {
+                            goto next_item;
+                        }
+                        break;
+                    case pa_stage_take:
+                        // The source is not asked for more once the last item got through.
+                        if(--s.count <= 0) {
+                            this->exhausted = true;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            v = x;
+            return true;
+        }
+};
+
+inline pa_value_t* pa_new_stage(pa_stage_kind_t kind, pa_value_t* func, pa_value_t* initial, int64_t count) {
+    pa_pipeline_t* p = new pa_pipeline_t(NULL, 1);
+    p->stages[0] = pa_stage_t{kind, func, initial, count};
+    return pa_new_sequence(p);
+}
+
+inline pa_value_t* pa_sequence_collect(pa_sequence_data* s) {
+    pa_value_t* r = pa_new_list();
+    pa_value_t* x;
+    while(s->next(x)) {
+        PV2LIST(r)->push_back(x);
     }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "<=");
+    return r;
 }
 
-inline pa_value_t* pa_operator_right(pa_value_t* a, pa_value_t* b) {
-    // Flow operator (right).
-    pa_value_t* n;
-    pa_list_t *l1, *l2;
-    pa_list_t::iterator it;
+// Runs a pipeline that ends with a reduce stage.
+inline pa_value_t* pa_pipeline_reduce(pa_pipeline_t* p) {
+    pa_stage_t& r = p->stages[--p->size];
+    pa_value_t* acc = r.initial;
+    pa_value_t* x;
+    while(p->next(x)) {
+        acc = pa_function_call(r.func, pa_list_t{acc, x}, pa_dict_t{}, p->_this);
+    }
+    return acc;
+}
+
+// `a -> b` where a is a list or a sequence and b a function (a map
+// stage) or stages waiting for a source. The result is one flat pipeline
+// over the source of a, with the stages of a and then those of b.
+inline pa_value_t* pa_sequence_right(pa_value_t* a, pa_value_t* b) {
+    pa_sequence_data* source;
+    pa_pipeline_t* head = NULL;
+    pa_pipeline_t* tail;
+    pa_pipeline_t* p;
+    pa_stage_t map;
+    pa_stage_t* more;
+    size_t n;
+    switch(b->type) {
+        case pa_function:
+            map = pa_stage_t{pa_stage_map, b, NULL, 0};
+            more = &map;
+            n = 1;
+            break;
+        case pa_sequence:
+            tail = dynamic_cast<pa_pipeline_t*>(b->value.seq);
+            if(!tail || tail->source) {
+                goto type_mismatch;
+            }
+            more = tail->stages;
+            n = tail->size;
+            break;
+        default:
+            goto type_mismatch;
+    }
     switch(a->type) {
         case pa_list:
-            switch(b->type) {
-                case pa_function:
-                    // map(list->list) with a func
-                    n = pa_new_list();
-                    l1 = PV2LIST(a);
-                    l2 = PV2LIST(n);
-                    for(it = l1->begin(); it != l1->end(); ++it){
-                        l2->push_back(pa_function_call(b, pa_list_t{*it}, pa_dict_t{}, a));
-                    }
-                    return n;
-                default:
-                    goto type_mismatch;
-            }
-        case pa_object:
-            n = a->value.obj->get_operator("->");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+            source = new pa_list_sequence_t(a);
+            break;
+        case pa_sequence:
+            head = dynamic_cast<pa_pipeline_t*>(a->value.seq);
+            if(head && head->size && head->stages[head->size - 1].kind == pa_stage_reduce) {
+                goto type_mismatch; // Nothing comes out of a reduce to flow on.
             }
+            source = head ? head->source : a->value.seq;
+            break;
         default:
-            goto type_mismatch; 
+            goto type_mismatch;
+    }
+
+    p = new pa_pipeline_t(source, (head ? head->size : 0) + n);
+    if(head) {
+        copy(head->stages, head->stages + head->size, p->stages);
+        p->exhausted = head->exhausted;
+    }
+    copy(more, more + n, p->stages + p->size - n);
+    if(!source) {
+        return pa_new_sequence(p);
+    }
+    for(size_t i = 0; i < p->size; i++) {
+        if(p->stages[i].kind == pa_stage_take && p->stages[i].count <= 0) {
+            p->exhausted = true;
+        }
+    }
+    if(p->stages[p->size - 1].kind == pa_stage_reduce) {
+        return pa_pipeline_reduce(p);
     }
+    if(a->type == pa_list) {
+        return pa_sequence_collect(p);
+    }
+    return pa_new_sequence(p);
 type_mismatch:
     throw pa_new_exception(_TypeMismatchException, "->");
 }
 
+// Generators
+//
+// A Pa function with `yield` in it compiles to its body wrapped by
+// pa_new_generator_function: a call gives a sequence that runs the body
+// on a stack of its own when the first item is asked for, and each
+// `yield` switches back to the consumer with an item. Exceptions raised in
+// the body come out of the call that asked for the next item.
+//
+// Stacks are $PA_GENERATOR_STACK_MB megabytes (PA_GENERATOR_STACK_MB by
+// default) of address space, mapped on first use with a guard page below,
+// so recursing too deep in a body faults there instead of running into
+// other memory. Only the pages a body touches are ever committed. A few
+// stacks of finished generators are kept per thread for the next ones.
+#ifndef PA_GENERATOR_STACK_MB
+#define PA_GENERATOR_STACK_MB 64
+#endif
 
-inline pa_value_t* pa_operator_or(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_boolean:
-            switch(b->type) {
-                case pa_boolean:
-                    return pa_new_boolean(a->value.b || b->value.b);
-                default:
-                    goto type_mismatch;
+#ifndef PA_GENERATOR_SPARE_STACKS
+#define PA_GENERATOR_SPARE_STACKS 8
+#endif
+
+// A generator's stack. While the generator is suspended the collector
+// scans it from the saved stack pointer up, through a mark procedure of
+// its own kind, and only as long as the generator is reachable; while it
+// runs, it is the thread's stack. It is unmapped once the body returns, or
+// when an abandoned generator is collected.
+class pa_generator_stack_t {
+    public:
+        char* low;  // The guard page
+        char* sp;   // Lowest live byte while suspended, top otherwise
+        char* top;
+
+        static size_t size() {
+            static const char* mb = getenv("PA_GENERATOR_STACK_MB");
+            static size_t size = (size_t)(mb && atol(mb) > 0 ? atol(mb) : PA_GENERATOR_STACK_MB) << 20;
+            return size;
+        }
+        static size_t guard() {
+            static size_t page = sysconf(_SC_PAGESIZE);
+            return page;
+        }
+        static vector<char*>& spare() {
+            static thread_local vector<char*> spare;
+            return spare;
+        }
+#if GC_VERSION_MAJOR >= 8
+        static struct GC_ms_entry* mark(GC_word* addr, struct GC_ms_entry* msp, struct GC_ms_entry* limit, GC_word env) {
+            pa_generator_stack_t* stack = (pa_generator_stack_t*)addr;
+            for(void** p = (void**)stack->sp; p < (void**)stack->top; p++) {
+                msp = GC_MARK_AND_PUSH(*p, msp, limit, p);
             }
-        case pa_object:
-            n = a->value.obj->get_operator("or");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
+            return msp;
+        }
+        static void finalize(void* obj, void* data) {
+            ((pa_generator_stack_t*)obj)->unmap();
+        }
+        static int kind() {
+            static int kind = GC_new_kind(GC_new_free_list(), GC_MAKE_PROC(GC_new_proc(mark), 0), 0, 1);
+            return kind;
+        }
+#endif
+        static pa_generator_stack_t* create() {
+            size_t size = pa_generator_stack_t::size() + pa_generator_stack_t::guard();
+            vector<char*>& spare = pa_generator_stack_t::spare();
+            char* low;
+            if(!spare.empty()) {
+                low = spare.back();
+                spare.pop_back();
             } else {
-                goto type_mismatch;
+                low = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+                if(low == (char*)MAP_FAILED) {
+                    throw bad_alloc();
+                }
+                mprotect(low, pa_generator_stack_t::guard(), PROT_NONE);
             }
-        default:
-            goto type_mismatch; 
-    }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "or");
+#if GC_VERSION_MAJOR >= 8
+            pa_generator_stack_t* stack = (pa_generator_stack_t*)GC_generic_malloc(sizeof(pa_generator_stack_t), pa_generator_stack_t::kind());
+            GC_register_finalizer_no_order(stack, pa_generator_stack_t::finalize, NULL, NULL, NULL);
+#else
+            pa_generator_stack_t* stack = (pa_generator_stack_t*)GC_MALLOC(sizeof(pa_generator_stack_t));
+#endif
+            stack->low = low;
+            stack->top = stack->sp = low + size;
+            return stack;
+        }
+        char* base() { return this->low + pa_generator_stack_t::guard(); }
+        void suspend(char* sp) {
+            this->sp = (char*)((uintptr_t)sp & ~(uintptr_t)(sizeof(void*) - 1));
+        }
+        void unmap() {
+            if(this->low) {
+                this->sp = this->top;
+                munmap(this->low, this->top - this->low);
+                this->low = NULL;
+            }
+        }
+        // Once the body has returned, from the thread it ran on.
+        void release() {
+            vector<char*>& spare = pa_generator_stack_t::spare();
+            if(this->low && spare.size() < PA_GENERATOR_SPARE_STACKS) {
+                spare.push_back(this->low);
+                this->sp = this->top;
+                this->low = NULL;
+            } else {
+                this->unmap();
+            }
+        }
+};
+
+class pa_generator_t;
+
+inline pa_generator_t*& pa_current_generator() {
+    static thread_local pa_generator_t* current = NULL;
+    return current;
 }
 
-inline pa_value_t* pa_operator_and(pa_value_t* a, pa_value_t* b) {
-    pa_value_t* n;
-    switch(a->type) {
-        case pa_boolean:
-            switch(b->type) {
-                case pa_boolean:
-                    return pa_new_boolean(a->value.b && b->value.b);
-                default:
-                    goto type_mismatch;
+class pa_generator_t : public pa_sequence_data {
+    public:
+        pa_value_t* func;
+        pa_list_t args;
+        pa_dict_t kwargs;
+        pa_value_t* _this;
+        pa_value_t* item;
+        pa_value_t* error;
+        exception_ptr native_error;
+        pa_generator_stack_t* stack;
+        ucontext_t context;
+        ucontext_t caller;
+        bool running;
+        bool finished;
+#ifdef PA_PROFILE
+        pa_profile_node_t* profile;
+#endif
+
+        pa_generator_t(pa_value_t* func, pa_list_t& args, pa_dict_t& kwargs, pa_value_t* _this)
+            : func(func), args(args), kwargs(kwargs), _this(_this), item(NULL), error(NULL), stack(NULL), running(false), finished(false) {
+#ifdef PA_PROFILE
+            this->profile = NULL;
+#endif
+        }
+        static void run(unsigned hi, unsigned lo) {
+            pa_generator_t* g = (pa_generator_t*)(((uint64_t)hi << 32) | lo);
+            try {
+                pa_function_call(g->func, g->args, g->kwargs, g->_this);
+            } catch(pa_value_t* e) {
+                g->error = e;
+            } catch(...) {
+                g->native_error = current_exception();
             }
-        case pa_object:
-            n = a->value.obj->get_operator("and");
-            if(n) {
-                return pa_function_call(n, pa_list_t{b}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+            g->finished = true;
+        } // Back to the caller through uc_link.
+        void resume() {
+            pa_generator_t*& current = pa_current_generator();
+            pa_generator_t* outer = current;
+            current = this;
+            this->running = true;
+            this->stack->sp = this->stack->top;
+#ifdef PA_PROFILE
+            pa_profile_node_t* profiled = pa_profile_current();
+            if(this->profile) {
+                pa_profile_current() = this->profile;
             }
-        default:
-            goto type_mismatch; 
+#endif
+#if GC_VERSION_MAJOR >= 8
+            // The collector scans the running stack from the stack pointer
+            // to its registered bottom; while the generator runs that is its
+            // own stack, and the suspended caller's becomes a root.
+            char top;
+            struct GC_stack_base below, own;
+            GC_get_my_stackbottom(&below);
+            own = below;
+            own.mem_base = this->stack->top;
+            GC_add_roots(&top, below.mem_base);
+            GC_set_stackbottom(NULL, &own);
+#endif
+            swapcontext(&this->caller, &this->context);
+#if GC_VERSION_MAJOR >= 8
+            GC_set_stackbottom(NULL, &below);
+            GC_remove_roots(&top, below.mem_base);
+#endif
+#ifdef PA_PROFILE
+            this->profile = pa_profile_current();
+            pa_profile_current() = profiled;
+#endif
+            this->running = false;
+            current = outer;
+        }
+        bool next(pa_value_t*& v) {
+            if(this->finished) {
+                return false;
+            }
+            if(this->running) {
+                throw pa_new_exception(_TypeMismatchException, "generator asked for an item by its own body");
+            }
+            if(!this->stack) {
+                uint64_t self = (uint64_t)(uintptr_t)this;
+                this->stack = pa_generator_stack_t::create();
+                getcontext(&this->context);
+                this->context.uc_stack.ss_sp = this->stack->base();
+                this->context.uc_stack.ss_size = this->stack->top - this->stack->base();
+                this->context.uc_link = &this->caller;
+                makecontext(&this->context, (void (*)())pa_generator_t::run, 2, (unsigned)(self >> 32), (unsigned)self);
+            }
+            this->resume();
+            if(this->finished) {
+                pa_value_t* e = this->error;
+                exception_ptr native_error = this->native_error;
+                this->stack->release();
+                this->stack = NULL;
+                this->error = NULL;
+                this->native_error = exception_ptr();
+                this->args.clear();
+                this->kwargs.clear();
+                if(e) {
+                    throw e;
+                }
+                if(native_error) {
+                    rethrow_exception(native_error);
+                }
+                return false;
+            }
+            v = this->item;
+            return true;
+        }
+};
+
+inline void pa_yield(pa_value_t* v) {
+    pa_generator_t* g = pa_current_generator();
+    if(!g) {
+        throw pa_new_exception(_TypeMismatchException, "yield outside a generator");
     }
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "and");
+    char here;
+    g->item = v;
+    g->stack->suspend(&here - 128); // With room for what this frame spills
+    swapcontext(&g->context, &g->caller);
 }
 
-inline pa_value_t* pa_operator_length(pa_value_t* a) {
-    pa_value_t* n;
-    pa_list_t* l;
-    pa_string_t* s;
-    switch(a->type) {
-        case pa_list:
-            l = PV2LIST(a);
-            return pa_new_integer(l->size());
-        case pa_string:
-            s = PV2STR(a);
-            return pa_new_integer(s->length());
-        case pa_object:
-            n = a->value.obj->get_operator("length");
-            if(n) {
-                return pa_function_call(n, pa_list_t{}, pa_dict_t{}, a);
-            } else {
-                goto type_mismatch;
+struct pa_generator_function_t {
+    pa_value_t* body;
+    pa_value_t* operator()(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) const {
+        return pa_new_sequence(new pa_generator_t(body, args, kwargs, _this));
+    }
+};
+
+inline pa_value_t* pa_new_generator_function(pa_value_t* body) {
+    return pa_new_function(pa_generator_function_t{body});
+}
+
+// What a for loop walks: a sequence item by item, anything else by index
+// up to the length it had when the loop started.
+class pa_for_t {
+    private:
+        pa_value_t* value;
+        int64_t index;
+        int64_t size;
+    public:
+        pa_for_t(pa_value_t* value) : value(value), index(0), size(value->type == pa_sequence ? 0 : pa_operator_length(value)->value.i64) {}
+        bool next(pa_value_t*& v) {
+            if(this->value->type == pa_sequence) {
+                return this->value->value.seq->next(v);
             }
-        default:
-            goto type_mismatch; 
+            if(this->index >= this->size) {
+                return false;
+            }
+            v = pa_operator_getitem(this->value, pa_new_integer(this->index++));
+            return true;
+        }
+};
+
+// Utilities
+
+// Loaded modules, keyed by the name they were imported with and by the
+// canonical path of the shared object, so each library is probed,
+// dlopen'ed and initialized only once per image.
+inline pa_module_map_t& pa_modules_by_name() {
+    static pa_module_map_t modules;
+    return modules;
+}
+
+inline pa_module_map_t& pa_modules_by_path() {
+    static pa_module_map_t modules;
+    return modules;
+}
+
+// Held while pa_import looks a module up or loads it, so threads importing
+// at once initialize each module only once. Recursive because a module's
+// PA_INIT can import other modules.
+inline recursive_mutex& pa_modules_lock() {
+    static recursive_mutex lock;
+    return lock;
+}
+
+// Wraps the export dictionary of a module into an object whose exports are
+// plain members, so `mod.name` is a single member lookup.
+inline pa_value_t* pa_new_module(pa_string_t name, pa_value_t* exports) {
+    pa_value_t* mod_class = pa_new_class();
+    pa_dict_t* d = PV2MAP(exports);
+    for(pa_dict_t::iterator it = d->begin(); it != d->end(); ++it) {
+        mod_class->value.cls->set_member(it->first, it->second);
     }
+    mod_class->value.cls->set_operator(pa_op_getattr, pa_new_function([=](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* {
+        throw pa_new_exception(_ImportException, pa_string_t("no such name in the module: ") + name);
+    }));
+    return pa_new_object(mod_class->value.cls);
+}
 
-type_mismatch:
-    throw pa_new_exception(_TypeMismatchException, "length");
+// Looks up an export of a module object without falling back to getattr.
+// Returns NULL when the module has no such member.
+inline pa_value_t* pa_module_member(pa_value_t* mod, pa_string_t name) {
+    if(mod->type != pa_object) {
+        return NULL;
+    }
+    return mod->value.obj->get_member(name);
 }
 
-inline bool pa_instanceof(pa_value_t* o, pa_value_t* cls) {
-    return o->value.obj->get_class() == cls->value.cls;
+// Modules linked into the executable (pypac -b), keyed by import name.
+inline map<pa_string_t, pa_value_t*(*)()>& pa_static_modules() {
+    static map<pa_string_t, pa_value_t*(*)()> modules;
+    return modules;
 }
 
-// Utilities
+class pa_static_module_t {
+    public:
+        pa_static_module_t(const char* name, pa_value_t*(*init)()) { pa_static_modules()[name] = init; }
+};
+
 inline pa_value_t* pa_import(pa_string_t name) {
-    replace(name.begin(), name.end(), '.', '/');
+    lock_guard<recursive_mutex> guard(pa_modules_lock());
+    pa_module_map_t& by_name = pa_modules_by_name();
+    pa_module_map_t::iterator found = by_name.find(name);
+    if(found != by_name.end()) {
+        return found->second;
+    }
+
+    map<pa_string_t, pa_value_t*(*)()>::iterator linked = pa_static_modules().find(name);
+    if(linked != pa_static_modules().end()) {
+        return by_name[name] = pa_new_module(name, linked->second());
+    }
+
+    pa_string_t file_name = name;
+    replace(file_name.begin(), file_name.end(), '.', '/');
 
     //TODO Make it functional on Windows, Mac as well.
     pa_string_t file_path;
-    pa_string_t file_name = "/" + name + ".so";
+    file_name = "/" + file_name + ".so";
     const char* pa_home = getenv("PA_HOME");
     pa_string_t paths_to_search[] = {
         ".",
@@ -847,55 +2326,161 @@ inline pa_value_t* pa_import(pa_string_t name) {
         }
     }
 
+    char canonical_path[PATH_MAX];
+    if(realpath(file_path.c_str(), canonical_path)) {
+        file_path = canonical_path;
+    }
+
+    pa_module_map_t& by_path = pa_modules_by_path();
+    found = by_path.find(file_path);
+    if(found != by_path.end()) {
+        return by_name[name] = found->second;
+    }
+
     void* handle = dlopen(file_path.c_str(), RTLD_NOW | RTLD_GLOBAL);
 
     if(handle) {
         pa_value_t*(*mod_init)() = (pa_value_t*(*)()) dlsym(handle, "PA_INIT");
+        if(!mod_init) {
+            throw pa_new_exception(_ImportException, dlerror());
+        }
+
+        pa_value_t* obj = pa_new_module(name, mod_init());
+        by_path[file_path] = obj;
+        by_name[name] = obj;
+        return obj;
+    } else {
+        throw pa_new_exception(_ImportException, dlerror());
+    }
+}
 
-        pa_value_t* mod = mod_init();
 
-        pa_value_t* mod_class = pa_new_class();
-        mod_class->value.cls->set_operator("getattr", pa_new_function([=](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* {
-            pa_value_t *__this = pa_get_argument(args, kwargs, 0, "", pa_new_nil());
-            pa_value_t *attr_name = pa_get_argument(args, kwargs, 1, "", pa_new_nil());
-            pa_value_t* attr = pa_operator_getitem(mod, attr_name); 
-            if(attr){ 
-                return attr; 
-            } else {
-                throw pa_new_exception(_ImportException, pa_string_t("no such name in the module: ") + name);
+// Buffered stdout. print writes here instead of calling printf once per
+// value; the buffer goes out when it is full, on flush(), before input() and
+// at exit. On a terminal every newline flushes, like line-buffered stdio.
+class pa_output_t {
+    char buffer[1 << 16];
+    size_t used;
+    bool line_buffered;
+public:
+    recursive_mutex lock; // Held across one print() call, toString included.
+
+    pa_output_t() : used(0), line_buffered(isatty(1)) {}
+    ~pa_output_t() { flush(); }
+
+    void append(const char* s, size_t n) {
+        if(used + n > sizeof(buffer)) {
+            flush();
+            if(n > sizeof(buffer)) {
+                write_all(s, n);
+                return;
             }
-        }));
+        }
+        memcpy(buffer + used, s, n);
+        used += n;
+        if(line_buffered && memchr(s, '\n', n)) {
+            flush();
+        }
+    }
 
-        pa_value_t* obj = pa_new_object(mod_class->value.cls);
-        return obj;
+    void flush() {
+        fflush(stdout); // Anything written with stdio goes first.
+        write_all(buffer, used);
+        used = 0;
+    }
+
+private:
+    static void write_all(const char* s, size_t n) {
+        while(n > 0) {
+            ssize_t w = ::write(1, s, n);
+            if(w < 0 && errno == EINTR) continue;
+            if(w <= 0) break;
+            s += w;
+            n -= w;
+        }
+    }
+};
+
+inline pa_output_t& pa_output() {
+    static pa_output_t out;
+    return out;
+}
+
+// Writes the digits of v backwards, two at a time, ending at end. Returns
+// where they start; 20 bytes are always enough.
+inline char* pa_format_integer(int64_t v, char* end) {
+    static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    char* p = end;
+    while(u >= 100) {
+        unsigned i = (unsigned)(u % 100) * 2;
+        u /= 100;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+    if(u >= 10) {
+        *--p = digits[u * 2 + 1];
+        *--p = digits[u * 2];
     } else {
-        throw pa_new_exception(_ImportException, dlerror());
+        *--p = '0' + (char)u;
     }
+    if(v < 0) *--p = '-';
+    return p;
 }
 
+// Same text as printf("%.15g"). Whole numbers, the common case, skip printf.
+inline size_t pa_format_float(double v, char* buf, size_t size) {
+    if(fabs(v) < 1e15 && v == floor(v) && !(v == 0 && signbit(v))) {
+        char tmp[24];
+        char* p = pa_format_integer((int64_t)v, tmp + sizeof(tmp));
+        memcpy(buf, p, tmp + sizeof(tmp) - p);
+        return tmp + sizeof(tmp) - p;
+    }
+    return snprintf(buf, size, "%.15g", v);
+}
 
-inline void pa_print_value(pa_value_t* v) {
+// Appends the text of v to w, anything with append(const char*, size_t):
+// pa_output_t for print, pa_string_t for str and format.
+template<typename W>
+void pa_write_value(W& w, pa_value_t* v) {
+    char buf[32];
+    char* p;
     pa_value_t* n;
-    pa_list_t* l;
-    pa_dict_t* d;
     switch(v->type) { 
         case pa_nil: 
-            printf("nil"); 
+            w.append("nil", 3);
             break; 
         case pa_integer: 
-            printf("%lld", (long long int)v->value.i64); 
+            p = pa_format_integer(v->value.i64, buf + sizeof(buf));
+            w.append(p, buf + sizeof(buf) - p);
             break; 
         case pa_float: 
-            printf("%lf", (double)v->value.f64); 
+            w.append(buf, pa_format_float(v->value.f64, buf, sizeof(buf)));
             break; 
+        case pa_array:
+            w.append("[", 1);
+            for(size_t i = 0; i < v->value.arr->size; i++) {
+                if(i) w.append(", ", 2);
+                if(v->value.arr->kind == pa_array_f64) {
+                    w.append(buf, pa_format_float(v->value.arr->data.f64[i], buf, sizeof(buf)));
+                } else {
+                    p = pa_format_integer(v->value.arr->data.i64[i], buf + sizeof(buf));
+                    w.append(p, buf + sizeof(buf) - p);
+                }
+            }
+            w.append("]", 1);
+            break;
         case pa_string: 
-            printf("%s", PV2STR(v)->c_str()); 
+            w.append(PV2STR(v)->data(), PV2STR(v)->size()); 
             break; 
         case pa_object:
             n = v->value.obj->get_member("toString");
             if(n) {
                 n = pa_function_call(n, pa_list_t{}, pa_dict_t{}, v);
-                pa_print_value(n);
+                pa_write_value(w, n);
                 break;
             } else {
                 throw pa_new_exception(_NoSuchAttributeException, "toString");   
@@ -905,8 +2490,137 @@ inline void pa_print_value(pa_value_t* v) {
     }    
 }
 
+inline void pa_print_value(pa_value_t* v) {
+    pa_output_t& out = pa_output();
+    lock_guard<recursive_mutex> guard(out.lock);
+    pa_write_value(out, v);
+}
+
+inline pa_value_t* pa_to_string(pa_value_t* v) {
+    if(v->type == pa_string) {
+        return v;
+    }
+    pa_string_t s;
+    pa_write_value(s, v);
+    return pa_new_string(move(s));
+}
+
+// format("{} of {}", a, b): each {} takes the next argument, {{ and }} are
+// literal braces. The result is built in place, without a string per value.
+inline pa_value_t* pa_format(pa_list_t& args) {
+    pa_list_t::iterator it = args.begin();
+    if(it == args.end()) {
+        throw pa_new_exception(_ArgumentRequiredException, "format");
+    }
+    if((*it)->type != pa_string) {
+        throw pa_new_exception(_TypeMismatchException, "format");
+    }
+    const pa_string_t& fmt = *PV2STR(*it++);
+    pa_string_t s;
+    s.reserve(fmt.size() + 16 * (args.size() - 1));
+    size_t i = 0, n = fmt.size();
+    while(i < n) {
+        size_t j = fmt.find_first_of("{}", i);
+        if(j == pa_string_t::npos) j = n;
+        s.append(fmt, i, j - i);
+        if(j == n) break;
+        if(j + 1 < n && fmt[j + 1] == fmt[j]) {
+            s.push_back(fmt[j]);
+        } else if(fmt[j] == '{' && j + 1 < n && fmt[j + 1] == '}') {
+            if(it == args.end()) {
+                throw pa_new_exception(_ArgumentRequiredException, "format: not enough arguments");
+            }
+            pa_write_value(s, *it++);
+        } else {
+            throw pa_new_exception(_TypeMismatchException, "format: unmatched brace");
+        }
+        i = j + 2;
+    }
+    return pa_new_string(move(s));
+}
+
+// The list intrinsics: append, extend, pop and insert.
+inline pa_list_t* pa_list_argument(pa_list_t& args, pa_dict_t& kwargs, const char* name) {
+    pa_value_t* l = pa_get_argument(args, kwargs, 0, "list", pa_new_nil());
+    if(l->type != pa_list) {
+        throw pa_new_exception(_TypeMismatchException, name);
+    }
+    return PV2LIST(l);
+}
+
+// Where index points in l, walking from the closer end. Negative indexes
+// count from the end; the end itself is a position only for insert.
+inline pa_list_t::iterator pa_list_position(pa_list_t* l, pa_value_t* index, bool end_allowed, const char* name) {
+    if(index->type != pa_integer) {
+        throw pa_new_exception(_TypeMismatchException, name);
+    }
+    int64_t size = l->size(), i = index->value.i64;
+    if(i < 0) i += size;
+    if(i < 0 || i > size || (i == size && !end_allowed)) {
+        throw pa_new_exception(_OutOfIndexException, pa_string_t(name) + " index out of range");
+    }
+    pa_list_t::iterator it;
+    if(i <= size / 2) {
+        it = l->begin();
+        advance(it, i);
+    } else {
+        it = l->end();
+        advance(it, i - size);
+    }
+    return it;
+}
+
+// The sequence intrinsics: lazy, collect, filter, take and reduce.
+inline pa_value_t* pa_lazy(pa_value_t* v) {
+    switch(v->type) {
+        case pa_list:
+            return pa_new_sequence(new pa_list_sequence_t(v));
+        case pa_sequence:
+            return v;
+        default:
+            throw pa_new_exception(_TypeMismatchException, "lazy");
+    }
+}
+
+inline pa_value_t* pa_collect(pa_value_t* v) {
+    switch(v->type) {
+        case pa_list:
+            return v;
+        case pa_sequence:
+            return pa_sequence_collect(v->value.seq);
+        default:
+            throw pa_new_exception(_TypeMismatchException, "collect");
+    }
+}
+
+inline pa_value_t* pa_function_argument(pa_list_t& args, pa_dict_t& kwargs, const char* name) {
+    pa_value_t* f = pa_get_argument(args, kwargs, 0, "func", pa_new_nil());
+    if(f->type != pa_function) {
+        throw pa_new_exception(_TypeMismatchException, name);
+    }
+    return f;
+}
+
+// The main thread's stack grows up to RLIMIT_STACK, often only 8 MB, and
+// deep recursion in Pa takes more. PA_ENTER raises the soft limit to
+// $PA_STACK_MB megabytes (PA_STACK_MB by default); it never lowers it.
+#ifndef PA_STACK_MB
+#define PA_STACK_MB 1024
+#endif
+
+inline void pa_grow_stack() {
+    const char* mb = getenv("PA_STACK_MB");
+    rlim_t size = (rlim_t)(mb ? atol(mb) : PA_STACK_MB) << 20;
+    struct rlimit r;
+    if(getrlimit(RLIMIT_STACK, &r) || r.rlim_cur == RLIM_INFINITY || r.rlim_cur >= size) {
+        return;
+    }
+    r.rlim_cur = (r.rlim_max != RLIM_INFINITY && size > r.rlim_max) ? r.rlim_max : size;
+    setrlimit(RLIMIT_STACK, &r);
+}
+
 inline void PA_ENTER(int argc, char** argv, char** env) {
-    //TODO 
+    pa_grow_stack();
     GC_INIT(); GC_enable_incremental();
 }
 
@@ -921,6 +2635,18 @@ inline int PA_LEAVE(pa_value_t *ret) {
     pa_value_t *_range; \
     pa_value_t *_input; \
     pa_value_t *_len; \
+    pa_value_t *_str; \
+    pa_value_t *_format; \
+    pa_value_t *_flush; \
+    pa_value_t *_append; \
+    pa_value_t *_extend; \
+    pa_value_t *_pop; \
+    pa_value_t *_insert; \
+    pa_value_t *_lazy; \
+    pa_value_t *_collect; \
+    pa_value_t *_filter; \
+    pa_value_t *_take; \
+    pa_value_t *_reduce; \
     _range = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
         pa_value_t *start = pa_get_argument(args, kwargs, 0, "start", pa_new_nil()); \
         pa_value_t *end = pa_get_argument(args, kwargs, 1, "end", pa_new_nil()); \
@@ -938,15 +2664,57 @@ inline int PA_LEAVE(pa_value_t *ret) {
         } \
     }); \
     _print = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_output_t& out = pa_output(); \
+        lock_guard<recursive_mutex> guard(out.lock); \
         pa_list_t::iterator it; \
         for(it = args.begin(); it != args.end(); ++it) { \
             pa_value_t* msg = *it; \
-            pa_print_value(msg); \
+            pa_write_value(out, msg); \
+        } \
+        return pa_new_nil(); \
+    }); \
+    _str = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        return pa_to_string(pa_get_argument(args, kwargs, 0, "value", pa_new_nil())); \
+    }); \
+    _format = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        return pa_format(args); \
+    }); \
+    _flush = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_output_t& out = pa_output(); \
+        lock_guard<recursive_mutex> guard(out.lock); \
+        out.flush(); \
+        return pa_new_nil(); \
+    }); \
+    _append = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_list_t* l = pa_list_argument(args, kwargs, "append"); \
+        l->push_back(pa_get_argument(args, kwargs, 1, "value", pa_new_nil())); \
+        return pa_new_nil(); \
+    }); \
+    _extend = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_list_argument(args, kwargs, "extend"); \
+        pa_value_t* values = pa_get_argument(args, kwargs, 1, "values", pa_new_nil()); \
+        if(values->type != pa_list) { \
+            throw pa_new_exception(_TypeMismatchException, "extend"); \
         } \
+        pa_operator_add_assign(pa_get_argument(args, kwargs, 0, "list", pa_new_nil()), values); \
+        return pa_new_nil(); \
+    }); \
+    _pop = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_list_t* l = pa_list_argument(args, kwargs, "pop"); \
+        pa_list_t::iterator it = pa_list_position(l, pa_get_argument(args, kwargs, 1, "index", pa_new_integer(-1)), false, "pop"); \
+        pa_value_t* v = *it; \
+        l->erase(it); \
+        return v; \
+    }); \
+    _insert = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_list_t* l = pa_list_argument(args, kwargs, "insert"); \
+        pa_list_t::iterator it = pa_list_position(l, pa_get_argument(args, kwargs, 1, "index", pa_new_nil()), true, "insert"); \
+        l->insert(it, pa_get_argument(args, kwargs, 2, "value", pa_new_nil())); \
         return pa_new_nil(); \
     }); \
     _input = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
         long long int N; \
+        pa_output().flush(); \
         register int t = scanf("%lld", &N); \
         pa_value_t* n = pa_new_integer(N); \
         return n; \
@@ -954,6 +2722,26 @@ inline int PA_LEAVE(pa_value_t *ret) {
     _len = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
         pa_value_t *o = pa_get_argument(args, kwargs, 0, "object", pa_new_nil()); \
         return pa_operator_length(o); \
+    }); \
+    _lazy = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        return pa_lazy(pa_get_argument(args, kwargs, 0, "object", pa_new_nil())); \
+    }); \
+    _collect = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        return pa_collect(pa_get_argument(args, kwargs, 0, "object", pa_new_nil())); \
+    }); \
+    _filter = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        return pa_new_stage(pa_stage_filter, pa_function_argument(args, kwargs, "filter"), NULL, 0); \
+    }); \
+    _take = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_value_t *n = pa_get_argument(args, kwargs, 0, "count", pa_new_nil()); \
+        if(n->type != pa_integer) { \
+            throw pa_new_exception(_TypeMismatchException, "take"); \
+        } \
+        return pa_new_stage(pa_stage_take, NULL, NULL, n->value.i64); \
+    }); \
+    _reduce = pa_new_function([](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* { \
+        pa_value_t *f = pa_function_argument(args, kwargs, "reduce"); \
+        return pa_new_stage(pa_stage_reduce, f, pa_get_argument(args, kwargs, 1, "initial", pa_new_nil()), 0); \
     });
 
 #endif
@@ -0,0 +1,152 @@
+#include <palang.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Builds an array of the given kind from a list, another array or a size
+// (zero-filled).
+pa_value_t* pa_array_from(pa_array_kind_t kind, pa_value_t* values, const char* name) {
+    pa_value_t* r;
+    pa_list_t* l;
+    pa_list_t::iterator it;
+    pa_array_data* src;
+    size_t i = 0;
+
+    switch(values->type) {
+        case pa_integer:
+            if(values->value.i64 < 0) {
+                goto type_mismatch;
+            }
+            r = pa_new_array(kind, values->value.i64);
+            memset(r->value.arr->data.ptr, 0, values->value.i64 * 8);
+            return r;
+        case pa_list:
+            l = PV2LIST(values);
+            r = pa_new_array(kind, l->size());
+            for(it = l->begin(); it != l->end(); ++it, ++i) {
+                if((*it)->type == pa_integer && kind == pa_array_i64) {
+                    r->value.arr->data.i64[i] = (*it)->value.i64;
+                } else if((*it)->type == pa_integer) {
+                    r->value.arr->data.f64[i] = (*it)->value.i64;
+                } else if((*it)->type == pa_float && kind == pa_array_f64) {
+                    r->value.arr->data.f64[i] = (*it)->value.f64;
+                } else {
+                    goto type_mismatch;
+                }
+            }
+            return r;
+        case pa_array:
+            src = values->value.arr;
+            r = pa_new_array(kind, src->size);
+            if(src->kind == kind) {
+                memcpy(r->value.arr->data.ptr, src->data.ptr, src->size * 8);
+            } else if(kind == pa_array_f64) {
+                for(i = 0; i < src->size; i++) r->value.arr->data.f64[i] = src->data.i64[i];
+            } else {
+                for(i = 0; i < src->size; i++) r->value.arr->data.i64[i] = (int64_t)src->data.f64[i];
+            }
+            return r;
+        default:
+            goto type_mismatch;
+    }
+type_mismatch:
+    throw pa_new_exception(_TypeMismatchException, name);
+}
+
+pa_array_data* pa_array_argument(pa_list_t& args, pa_dict_t& kwargs, size_t nth, const pa_string_t name, const char* fn) {
+    pa_value_t* a = pa_get_argument(args, kwargs, nth, name, pa_new_nil());
+    if(a->type != pa_array) {
+        throw pa_new_exception(_TypeMismatchException, fn);
+    }
+    return a->value.arr;
+}
+
+pa_value_t* __ints(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* values = pa_get_argument(args, kwargs, 0, "values", pa_new_nil());
+    return pa_array_from(pa_array_i64, values, "ints");
+}
+
+pa_value_t* __floats(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* values = pa_get_argument(args, kwargs, 0, "values", pa_new_nil());
+    return pa_array_from(pa_array_f64, values, "floats");
+}
+
+// Same bounds as the range intrinsic, end included.
+pa_value_t* __range(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* start = pa_get_argument(args, kwargs, 0, "start", pa_new_nil());
+    pa_value_t* end = pa_get_argument(args, kwargs, 1, "end", pa_new_nil());
+    pa_value_t* step = pa_get_argument(args, kwargs, 2, "step", pa_new_integer(1));
+
+    if(start->type != pa_integer || end->type != pa_integer || step->type != pa_integer || step->value.i64 <= 0) {
+        throw pa_new_exception(_TypeMismatchException, "range");
+    }
+    int64_t n = end->value.i64 < start->value.i64 ? 0 : (end->value.i64 - start->value.i64) / step->value.i64 + 1;
+    pa_value_t* r = pa_new_array(pa_array_i64, n);
+    for(int64_t i = 0; i < n; i++) {
+        r->value.arr->data.i64[i] = start->value.i64 + i * step->value.i64;
+    }
+    return r;
+}
+
+pa_value_t* __sum(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_array_data* a = pa_array_argument(args, kwargs, 0, "array", "sum");
+    if(a->kind == pa_array_f64) {
+        return pa_new_float(pa_simd_sum<pa_vf64_t>(a->data.f64, a->size));
+    }
+    return pa_new_integer(pa_simd_sum<pa_vi64_t>(a->data.i64, a->size));
+}
+
+pa_value_t* __dot(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_array_data* a = pa_array_argument(args, kwargs, 0, "a", "dot");
+    pa_array_data* b = pa_array_argument(args, kwargs, 1, "b", "dot");
+    if(a->size != b->size) {
+        throw pa_new_exception(_TypeMismatchException, "dot: arrays of different sizes");
+    }
+    if(a->kind == pa_array_i64 && b->kind == pa_array_i64) {
+        return pa_new_integer(pa_simd_dot<pa_vi64_t>(a->data.i64, b->data.i64, a->size));
+    }
+    return pa_new_float(pa_simd_dot<pa_vf64_t>(pa_array_as_f64(a), pa_array_as_f64(b), a->size));
+}
+
+template<bool Max>
+pa_value_t* pa_array_extreme(pa_list_t& args, pa_dict_t& kwargs, const char* name) {
+    pa_array_data* a = pa_array_argument(args, kwargs, 0, "array", name);
+    if(a->size == 0) {
+        throw pa_new_exception(_OutOfIndexException, pa_string_t(name) + " of an empty array");
+    }
+    if(a->kind == pa_array_f64) {
+        return pa_new_float(pa_simd_extreme<pa_vf64_t, double, Max>(a->data.f64, a->size));
+    }
+    return pa_new_integer(pa_simd_extreme<pa_vi64_t, int64_t, Max>(a->data.i64, a->size));
+}
+
+pa_value_t* __min(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    return pa_array_extreme<false>(args, kwargs, "min");
+}
+
+pa_value_t* __max(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    return pa_array_extreme<true>(args, kwargs, "max");
+}
+
+pa_value_t* __list(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_array_data* a = pa_array_argument(args, kwargs, 0, "array", "list");
+    pa_value_t* r = pa_new_list();
+    pa_list_t* l = PV2LIST(r);
+    for(size_t i = 0; i < a->size; i++) {
+        l->push_back(a->kind == pa_array_f64 ? pa_new_float(a->data.f64[i]) : pa_new_integer(a->data.i64[i]));
+    }
+    return r;
+}
+
+extern "C" pa_value_t* PA_INIT() {
+    return pa_new_dictionary(
+        pa_new_dictionary_kv(pa_new_string("ints"), pa_new_function(__ints)),
+        pa_new_dictionary_kv(pa_new_string("floats"), pa_new_function(__floats)),
+        pa_new_dictionary_kv(pa_new_string("range"), pa_new_function(__range)),
+        pa_new_dictionary_kv(pa_new_string("sum"), pa_new_function(__sum)),
+        pa_new_dictionary_kv(pa_new_string("dot"), pa_new_function(__dot)),
+        pa_new_dictionary_kv(pa_new_string("min"), pa_new_function(__min)),
+        pa_new_dictionary_kv(pa_new_string("max"), pa_new_function(__max)),
+        pa_new_dictionary_kv(pa_new_string("list"), pa_new_function(__list))
+    );
+}
@@ -36,7 +36,7 @@ pa_value_t* __read(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
     size_t szRead = fread(buffer, sizeof(char), 1024, fp);
 
 
-    return pa_new_string(pa_string_t(buffer));
+    return pa_new_string(pa_string_t(buffer, szRead));
 }
 
 pa_value_t* __write(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
@@ -50,12 +50,43 @@ pa_value_t* __write(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
     return pa_new_nil();
 }
 
+// Lines of an open file, without their "\n", read as they are asked for.
+class pa_file_lines_t : public pa_sequence_data {
+    public:
+        FILE* fp;
+        char* line;
+        size_t capacity;
+        pa_file_lines_t(FILE* fp) : fp(fp), line(NULL), capacity(0) {}
+        bool next(pa_value_t*& v) {
+            ssize_t n = getline(&this->line, &this->capacity, this->fp);
+            if(n < 0) {
+                free(this->line);
+                this->line = NULL;
+                return false;
+            }
+            if(n > 0 && this->line[n - 1] == '\n') n--;
+            v = pa_new_string(pa_string_t(this->line, n));
+            return true;
+        }
+};
+
+pa_value_t* __lines(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* handle = pa_get_argument(args, kwargs, 0, "handle", pa_new_nil());
+
+    FILE* fp = (FILE*)handle->value.ptr;
+    if(!fp) {
+        throw pa_new_exception(_TypeMismatchException, "file.lines");
+    }
+
+    return pa_new_sequence(new pa_file_lines_t(fp));
+}
 
 extern "C" pa_value_t* PA_INIT() {
     return pa_new_dictionary(
         pa_new_dictionary_kv(pa_new_string("open"), pa_new_function(__open)),
         pa_new_dictionary_kv(pa_new_string("close"), pa_new_function(__close)),
         pa_new_dictionary_kv(pa_new_string("write"), pa_new_function(__write)),
-        pa_new_dictionary_kv(pa_new_string("read"), pa_new_function(__read))
+        pa_new_dictionary_kv(pa_new_string("read"), pa_new_function(__read)),
+        pa_new_dictionary_kv(pa_new_string("lines"), pa_new_function(__lines))
     );       
 }
@@ -0,0 +1,620 @@
+#include <palang.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// JSON to Pa values and back.
+//
+// parse() builds lists, dictionaries, strings, integers (floats when the
+// number has a fraction, an exponent or does not fit in 64 bits), booleans
+// and nil in one pass over the text. stringify() writes into a per-thread
+// buffer that keeps its capacity from call to call. parser() and feed()
+// take a stream in chunks of any size and return every top-level value
+// completed so far; only the bytes added since the last chunk are scanned.
+//
+// String contents, and the text between structural characters while
+// streaming, are skipped 16 bytes at a time with SSE2.
+
+#ifndef PA_JSON_MAX_DEPTH
+#define PA_JSON_MAX_DEPTH 1024
+#endif
+
+PA_RUNTIME_ERROR(JSONException)
+#define _JSONException _pa_runtime_error_JSONException()
+
+// The first quote, backslash or control character in [p, end), or end.
+inline const char* pa_json_string_end(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for(; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        int bits = _mm_movemask_epi8(m);
+        if(bits) {
+            return p + __builtin_ctz(bits);
+        }
+    }
+#endif
+    while(p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+    return p;
+}
+
+// The first quote or bracket in [p, end), or end.
+inline const char* pa_json_structural(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i open = _mm_set1_epi8('[');
+    const __m128i close = _mm_set1_epi8(']');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    for(; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        // '{' and '}' are '[' and ']' with 0x20 set.
+        __m128i folded = _mm_andnot_si128(case_bit, v);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        int bits = _mm_movemask_epi8(m);
+        if(bits) {
+            return p + __builtin_ctz(bits);
+        }
+    }
+#endif
+    while(p < end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']') p++;
+    return p;
+}
+
+class pa_json_parser_t {
+    public:
+        const char* begin;
+        const char* p;
+        const char* end;
+        int depth;
+
+        pa_json_parser_t(const char* text, size_t size) : begin(text), p(text), end(text + size), depth(0) {}
+
+        void fail(const char* what) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "%s at offset %ld", what, (long)(p - begin));
+            throw pa_new_exception(_JSONException, msg);
+        }
+
+        void skip_blanks() {
+            while(p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+        }
+
+        // The whole text is one value, with blanks around it.
+        pa_value_t* document() {
+            skip_blanks();
+            pa_value_t* v = value();
+            skip_blanks();
+            if(p != end) fail("unexpected text after the value");
+            return v;
+        }
+
+        pa_value_t* value() {
+            if(p == end) fail("unexpected end");
+            switch(*p) {
+                case '{': return object();
+                case '[': return array();
+                case '"': p++; return pa_new_string(string_body());
+                case 't': return literal("true", 4, pa_new_boolean(true));
+                case 'f': return literal("false", 5, pa_new_boolean(false));
+                case 'n': return literal("null", 4, pa_new_nil());
+                default: return number();
+            }
+        }
+
+        pa_value_t* literal(const char* text, size_t size, pa_value_t* v) {
+            if((size_t)(end - p) < size || memcmp(p, text, size) != 0) fail("unexpected character");
+            p += size;
+            return v;
+        }
+
+        pa_value_t* object() {
+            if(++depth > PA_JSON_MAX_DEPTH) fail("nested too deeply");
+            p++;
+            pa_value_t* r = pa_new_dictionary();
+            pa_dict_t* d = PV2MAP(r);
+            skip_blanks();
+            if(p < end && *p == '}') {
+                p++;
+                depth--;
+                return r;
+            }
+            pa_dict_t::iterator hint = d->end();
+            for(;;) {
+                skip_blanks();
+                if(p == end || *p != '"') fail("expected a key");
+                p++;
+                pa_string_t key = string_body();
+                skip_blanks();
+                if(p == end || *p != ':') fail("expected ':'");
+                p++;
+                skip_blanks();
+                pa_value_t* v = value();
+                // Keys often come sorted; the hint makes those inserts O(1).
+                hint = d->insert(hint, make_pair(move(key), v));
+                hint->second = v; // A repeated key keeps its last value.
+                ++hint;
+                skip_blanks();
+                if(p < end && *p == ',') {
+                    p++;
+                } else if(p < end && *p == '}') {
+                    p++;
+                    break;
+                } else {
+                    fail("expected ',' or '}'");
+                }
+            }
+            depth--;
+            return r;
+        }
+
+        pa_value_t* array() {
+            if(++depth > PA_JSON_MAX_DEPTH) fail("nested too deeply");
+            p++;
+            pa_value_t* r = pa_new_list();
+            pa_list_t* l = PV2LIST(r);
+            skip_blanks();
+            if(p < end && *p == ']') {
+                p++;
+                depth--;
+                return r;
+            }
+            for(;;) {
+                skip_blanks();
+                l->push_back(value());
+                skip_blanks();
+                if(p < end && *p == ',') {
+                    p++;
+                } else if(p < end && *p == ']') {
+                    p++;
+                    break;
+                } else {
+                    fail("expected ',' or ']'");
+                }
+            }
+            depth--;
+            return r;
+        }
+
+        unsigned hex4() {
+            if(end - p < 4) fail("bad \\u escape");
+            unsigned u = 0;
+            for(int i = 0; i < 4; i++, p++) {
+                char c = *p;
+                u <<= 4;
+                if(c >= '0' && c <= '9') u |= c - '0';
+                else if(c >= 'a' && c <= 'f') u |= c - 'a' + 10;
+                else if(c >= 'A' && c <= 'F') u |= c - 'A' + 10;
+                else fail("bad \\u escape");
+            }
+            return u;
+        }
+
+        void utf8(pa_string_t& s, unsigned u) {
+            if(u < 0x80) {
+                s += (char)u;
+            } else if(u < 0x800) {
+                s += (char)(0xc0 | (u >> 6));
+                s += (char)(0x80 | (u & 0x3f));
+            } else if(u < 0x10000) {
+                s += (char)(0xe0 | (u >> 12));
+                s += (char)(0x80 | ((u >> 6) & 0x3f));
+                s += (char)(0x80 | (u & 0x3f));
+            } else {
+                s += (char)(0xf0 | (u >> 18));
+                s += (char)(0x80 | ((u >> 12) & 0x3f));
+                s += (char)(0x80 | ((u >> 6) & 0x3f));
+                s += (char)(0x80 | (u & 0x3f));
+            }
+        }
+
+        // The contents of a string whose opening quote is consumed.
+        pa_string_t string_body() {
+            const char* run = pa_json_string_end(p, end);
+            if(run < end && *run == '"') {
+                pa_string_t s(p, run - p);
+                p = run + 1;
+                return s;
+            }
+            pa_string_t s;
+            for(;;) {
+                s.append(p, run - p);
+                p = run;
+                if(p == end) fail("unterminated string");
+                if(*p == '"') {
+                    p++;
+                    return s;
+                }
+                if(*p != '\\') fail("control character in a string");
+                if(++p == end) fail("unterminated string");
+                switch(*p++) {
+                    case '"': s += '"'; break;
+                    case '\\': s += '\\'; break;
+                    case '/': s += '/'; break;
+                    case 'b': s += '\b'; break;
+                    case 'f': s += '\f'; break;
+                    case 'n': s += '\n'; break;
+                    case 'r': s += '\r'; break;
+                    case 't': s += '\t'; break;
+                    case 'u': {
+                        unsigned u = hex4();
+                        if(u >= 0xd800 && u < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                            const char* save = p;
+                            p += 2;
+                            unsigned low = hex4();
+                            if(low >= 0xdc00 && low < 0xe000) {
+                                u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+                            } else {
+                                p = save;
+                            }
+                        }
+                        utf8(s, u);
+                        break;
+                    }
+                    default:
+                        p--;
+                        fail("bad escape");
+                }
+                run = pa_json_string_end(p, end);
+            }
+        }
+
+        pa_value_t* number() {
+            const char* start = p;
+            bool negative = false;
+            if(p < end && *p == '-') {
+                negative = true;
+                p++;
+            }
+            if(p == end || *p < '0' || *p > '9') fail("unexpected character");
+            uint64_t u = 0;
+            int digits = 0;
+            if(*p == '0') {
+                p++;
+                digits = 1;
+            } else {
+                while(p < end && *p >= '0' && *p <= '9') {
+                    u = u * 10 + (*p - '0');
+                    digits++;
+                    p++;
+                }
+            }
+            bool integral = true;
+            if(p < end && *p == '.') {
+                integral = false;
+                p++;
+                if(p == end || *p < '0' || *p > '9') fail("bad number");
+                while(p < end && *p >= '0' && *p <= '9') p++;
+            }
+            if(p < end && (*p == 'e' || *p == 'E')) {
+                integral = false;
+                p++;
+                if(p < end && (*p == '+' || *p == '-')) p++;
+                if(p == end || *p < '0' || *p > '9') fail("bad number");
+                while(p < end && *p >= '0' && *p <= '9') p++;
+            }
+            // 18 digits never overflow; 19 only fit below 2^63.
+            if(integral && (digits < 19 || (digits == 19 && u <= (uint64_t)INT64_MAX + negative))) {
+                return pa_new_integer(negative ? (int64_t)(0 - u) : (int64_t)u);
+            }
+            char buf[64];
+            size_t size = p - start;
+            if(size < sizeof(buf)) {
+                memcpy(buf, start, size);
+                buf[size] = 0;
+                return pa_new_float(strtod(buf, NULL));
+            }
+            return pa_new_float(strtod(string(start, size).c_str(), NULL));
+        }
+};
+
+template<typename W>
+void pa_json_write_string(W& w, const char* p, const char* end) {
+    static const char hex[] = "0123456789abcdef";
+    w.append("\"", 1);
+    for(;;) {
+        const char* run = pa_json_string_end(p, end);
+        w.append(p, run - p);
+        if(run == end) {
+            break;
+        }
+        unsigned char c = *run;
+        switch(c) {
+            case '"': w.append("\\\"", 2); break;
+            case '\\': w.append("\\\\", 2); break;
+            case '\n': w.append("\\n", 2); break;
+            case '\r': w.append("\\r", 2); break;
+            case '\t': w.append("\\t", 2); break;
+            case '\b': w.append("\\b", 2); break;
+            case '\f': w.append("\\f", 2); break;
+            default: {
+                char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                w.append(u, 6);
+            }
+        }
+        p = run + 1;
+    }
+    w.append("\"", 1);
+}
+
+// The shortest of %.15g, %.16g and %.17g that reads back as the same
+// double, with ".0" added to whole numbers so they parse back as floats.
+inline size_t pa_json_format_float(double v, char* buf, size_t size) {
+    if(!isfinite(v)) {
+        throw pa_new_exception(_TypeMismatchException, "json.stringify: infinite or NaN float");
+    }
+    size_t n = 0;
+    for(int precision = 15; precision <= 17; precision++) {
+        n = snprintf(buf, size, "%.*g", precision, v);
+        if(strtod(buf, NULL) == v) break;
+    }
+    if(!strpbrk(buf, ".en")) {
+        buf[n++] = '.';
+        buf[n++] = '0';
+        buf[n] = 0;
+    }
+    return n;
+}
+
+template<typename W>
+void pa_json_write(W& w, pa_value_t* v, int depth) {
+    char buf[40];
+    char* p;
+    if(depth > PA_JSON_MAX_DEPTH) {
+        throw pa_new_exception(_JSONException, "json.stringify: nested too deeply");
+    }
+    switch(v->type) {
+        case pa_nil:
+            w.append("null", 4);
+            break;
+        case pa_boolean:
+            if(v->value.b) w.append("true", 4);
+            else w.append("false", 5);
+            break;
+        case pa_integer:
+            p = pa_format_integer(v->value.i64, buf + sizeof(buf));
+            w.append(p, buf + sizeof(buf) - p);
+            break;
+        case pa_float:
+            w.append(buf, pa_json_format_float(v->value.f64, buf, sizeof(buf)));
+            break;
+        case pa_string:
+            pa_json_write_string(w, PV2STR(v)->data(), PV2STR(v)->data() + PV2STR(v)->size());
+            break;
+        case pa_list: {
+            pa_list_t* l = PV2LIST(v);
+            w.append("[", 1);
+            for(pa_list_t::iterator it = l->begin(); it != l->end(); ++it) {
+                if(it != l->begin()) w.append(",", 1);
+                pa_json_write(w, *it, depth + 1);
+            }
+            w.append("]", 1);
+            break;
+        }
+        case pa_dictionary: {
+            pa_dict_t* d = PV2MAP(v);
+            w.append("{", 1);
+            for(pa_dict_t::iterator it = d->begin(); it != d->end(); ++it) {
+                if(it != d->begin()) w.append(",", 1);
+                pa_json_write_string(w, it->first.data(), it->first.data() + it->first.size());
+                w.append(":", 1);
+                pa_json_write(w, it->second, depth + 1);
+            }
+            w.append("}", 1);
+            break;
+        }
+        case pa_array:
+            w.append("[", 1);
+            for(size_t i = 0; i < v->value.arr->size; i++) {
+                if(i) w.append(",", 1);
+                if(v->value.arr->kind == pa_array_f64) {
+                    w.append(buf, pa_json_format_float(v->value.arr->data.f64[i], buf, sizeof(buf)));
+                } else {
+                    p = pa_format_integer(v->value.arr->data.i64[i], buf + sizeof(buf));
+                    w.append(p, buf + sizeof(buf) - p);
+                }
+            }
+            w.append("]", 1);
+            break;
+        default:
+            throw pa_new_exception(_TypeMismatchException, "json.stringify");
+    }
+}
+
+// Top-level values of a stream, found as chunks arrive.
+class pa_json_stream_t : public gc {
+    public:
+        pa_string_t buffer; // From the start of the current value on
+        size_t scanned;     // Bytes of buffer already looked at
+        int depth;
+        bool in_value, in_string, scalar;
+        pa_list_t held;     // Values completed before a bad one, for the next feed
+
+        pa_json_stream_t() : scanned(0), depth(0), in_value(false), in_string(false), scalar(false) {}
+
+        // Parses the first size bytes as one value. A bad value is dropped
+        // along with its bytes before the error goes up, so the stream
+        // carries on with whatever follows it.
+        void emit(pa_list_t* out, size_t size) {
+            pa_value_t* v;
+            try {
+                pa_json_parser_t parser(buffer.data(), size);
+                v = parser.document();
+            } catch(pa_value_t* e) {
+                drop(size);
+                throw;
+            }
+            out->push_back(v);
+            drop(size);
+        }
+
+        void drop(size_t size) {
+            in_value = in_string = scalar = false;
+            depth = 0;
+            buffer.erase(0, size);
+            scanned -= size;
+        }
+
+        void feed(pa_list_t* out) {
+            const char* base = buffer.data();
+            size_t size = buffer.size();
+            size_t i = scanned;
+            while(i < size) {
+                char c = base[i];
+                if(!in_value) {
+                    if(c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                        i++;
+                        continue;
+                    }
+                    buffer.erase(0, i); // Blanks before the value
+                    base = buffer.data();
+                    size = buffer.size();
+                    i = 0;
+                    in_value = true;
+                    if(c == '{' || c == '[') {
+                        depth = 1;
+                    } else if(c == '"') {
+                        in_string = true;
+                    } else {
+                        scalar = true;
+                        continue;
+                    }
+                    i++;
+                } else if(scalar) {
+                    // Ends at a blank or at the start of the next value;
+                    // at the end of the chunk it may still go on.
+                    while(i < size && !strchr(" \n\r\t{}[]\",", base[i])) i++;
+                    if(i == size) break;
+                    if(i == 0) i = 1; // A stray , ] or } is a bad value of its own.
+                    scanned = i;
+                    emit(out, i);
+                    base = buffer.data();
+                    size = buffer.size();
+                    i = 0;
+                } else if(in_string) {
+                    i = pa_json_string_end(base + i, base + size) - base;
+                    if(i == size) break;
+                    if(base[i] == '\\') {
+                        if(i + 1 == size) break; // Look at the escape again with the next chunk.
+                        i += 2;
+                    } else if(base[i] == '"') {
+                        in_string = false;
+                        i++;
+                        if(depth == 0) {
+                            scanned = i;
+                            emit(out, i);
+                            base = buffer.data();
+                            size = buffer.size();
+                            i = 0;
+                        }
+                    } else {
+                        i++; // A control character; parsing the value reports it.
+                    }
+                } else {
+                    i = pa_json_structural(base + i, base + size) - base;
+                    if(i == size) break;
+                    c = base[i++];
+                    if(c == '"') {
+                        in_string = true;
+                    } else if(c == '{' || c == '[') {
+                        depth++;
+                    } else if(--depth == 0) {
+                        scanned = i;
+                        emit(out, i);
+                        base = buffer.data();
+                        size = buffer.size();
+                        i = 0;
+                    }
+                }
+            }
+            scanned = i;
+            if(!in_value) {
+                buffer.clear();
+                scanned = 0;
+            }
+        }
+};
+
+pa_json_stream_t* pa_json_stream_argument(pa_list_t& args, pa_dict_t& kwargs, const char* fn) {
+    pa_value_t* stream = pa_get_argument(args, kwargs, 0, "stream", pa_new_nil());
+    if(stream->type != pa_integer || !stream->value.ptr) {
+        throw pa_new_exception(_TypeMismatchException, fn);
+    }
+    return (pa_json_stream_t*)stream->value.ptr;
+}
+
+pa_value_t* __parse(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* text = pa_get_argument(args, kwargs, 0, "text", pa_new_nil());
+    if(text->type != pa_string) {
+        throw pa_new_exception(_TypeMismatchException, "json.parse");
+    }
+    pa_json_parser_t parser(PV2STR(text)->data(), PV2STR(text)->size());
+    return parser.document();
+}
+
+pa_value_t* __stringify(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* value = pa_get_argument(args, kwargs, 0, "value", pa_new_nil());
+    static thread_local string buffer;
+    buffer.clear();
+    pa_json_write(buffer, value, 0);
+    return pa_new_string(pa_string_t(buffer.data(), buffer.size()));
+}
+
+pa_value_t* __parser(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    return pa_new_integer((int64_t)new pa_json_stream_t);
+}
+
+// feed(stream, chunk): the values the chunk completed, in a list. A bad
+// value raises JSONException and is skipped; values the chunk completed
+// before it are returned by the next feed or finish.
+pa_value_t* __feed(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_json_stream_t* s = pa_json_stream_argument(args, kwargs, "json.feed");
+    pa_value_t* chunk = pa_get_argument(args, kwargs, 1, "chunk", pa_new_nil());
+    if(chunk->type != pa_string) {
+        throw pa_new_exception(_TypeMismatchException, "json.feed");
+    }
+    pa_value_t* r = pa_new_list();
+    PV2LIST(r)->swap(s->held);
+    s->buffer.append(*PV2STR(chunk));
+    try {
+        s->feed(PV2LIST(r));
+    } catch(pa_value_t* e) {
+        s->held.swap(*PV2LIST(r));
+        throw;
+    }
+    return r;
+}
+
+// finish(stream): a value the end of the stream completes, such as a
+// trailing number, in a list. Raises if a value is left unfinished.
+pa_value_t* __finish(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_json_stream_t* s = pa_json_stream_argument(args, kwargs, "json.finish");
+    pa_value_t* r = pa_new_list();
+    PV2LIST(r)->swap(s->held);
+    if(s->in_value && s->scalar) {
+        s->scanned = s->buffer.size();
+        s->emit(PV2LIST(r), s->buffer.size());
+    }
+    if(s->in_value) {
+        throw pa_new_exception(_JSONException, "unexpected end of the stream");
+    }
+    return r;
+}
+
+extern "C" pa_value_t* PA_INIT() {
+    return pa_new_dictionary(
+        pa_new_dictionary_kv(pa_new_string("parse"), pa_new_function(__parse)),
+        pa_new_dictionary_kv(pa_new_string("stringify"), pa_new_function(__stringify)),
+        pa_new_dictionary_kv(pa_new_string("parser"), pa_new_function(__parser)),
+        pa_new_dictionary_kv(pa_new_string("feed"), pa_new_function(__feed)),
+        pa_new_dictionary_kv(pa_new_string("finish"), pa_new_function(__finish)),
+        pa_new_dictionary_kv(pa_new_string("JSONException"), _JSONException)
+    );
+}
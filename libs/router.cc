@@ -0,0 +1,367 @@
+#include <palang.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Radix tree router.
+//
+// Patterns are static text with `:name` segments, which match up to the
+// next '/', and an optional trailing `*name`, which matches the rest of the
+// path. Routes are collected by add() and compiled into flat arrays on the
+// first match after a change: nodes are numbered so that the static
+// children of a node are contiguous, and every string lives in one text
+// pool. A lookup walks the path once, trying static children before the
+// parameter and the wildcard child and backtracking only when a branch dead
+// ends. Parameters are kept as spans of the path until a route matched.
+// Routes are meant to be added before matching starts; add() while other
+// threads match is not supported.
+
+struct pa_route_t {
+    pa_string_t method;
+    pa_string_t pattern;
+    pa_value_t* handler;
+};
+
+struct pa_route_node_t {
+    uint32_t prefix, prefix_length;  // Static text, in text
+    uint32_t first_child, children;  // Static children, in nodes
+    int32_t param, wildcard;         // Nodes, or -1
+    uint32_t first_handler, handlers;
+};
+
+struct pa_route_handler_t {
+    uint32_t method, method_length;  // In text; "*" is any method
+    uint32_t first_name, names;      // Parameter names, in order
+    pa_value_t* handler;
+};
+
+struct pa_route_span_t {
+    uint32_t offset, length;
+};
+
+class pa_router_t : public gc {
+    public:
+        vector<pa_route_t, gc_allocator<pa_route_t>> routes;
+        vector<pa_route_node_t, gc_allocator<pa_route_node_t>> nodes;
+        vector<pa_route_handler_t, gc_allocator<pa_route_handler_t>> handlers;
+        vector<pa_route_span_t, gc_allocator<pa_route_span_t>> names;
+        pa_string_t text;
+        atomic<bool> dirty;
+        mutex lock;
+};
+
+// The tree while it is built; compile() flattens it.
+struct pa_route_build_t {
+    string prefix;
+    vector<pa_route_build_t*> children;
+    pa_route_build_t* param;
+    pa_route_build_t* wildcard;
+    vector<const pa_route_t*> routes;
+    pa_route_build_t() : param(NULL), wildcard(NULL) {}
+    ~pa_route_build_t() {
+        for(size_t i = 0; i < children.size(); i++) delete children[i];
+        delete param;
+        delete wildcard;
+    }
+};
+
+// The node at the end of the static text s, below node.
+pa_route_build_t* pa_route_insert_static(pa_route_build_t* node, string s) {
+    while(!s.empty()) {
+        pa_route_build_t* c = NULL;
+        size_t at = 0;
+        for(; at < node->children.size(); at++) {
+            if(node->children[at]->prefix[0] == s[0]) {
+                c = node->children[at];
+                break;
+            }
+        }
+        if(!c) {
+            c = new pa_route_build_t;
+            c->prefix = s;
+            node->children.push_back(c);
+            return c;
+        }
+        size_t common = 0;
+        while(common < c->prefix.size() && common < s.size() && c->prefix[common] == s[common]) common++;
+        if(common < c->prefix.size()) {
+            pa_route_build_t* split = new pa_route_build_t;
+            split->prefix = c->prefix.substr(0, common);
+            c->prefix = c->prefix.substr(common);
+            split->children.push_back(c);
+            node->children[at] = split;
+            c = split;
+        }
+        s = s.substr(common);
+        node = c;
+    }
+    return node;
+}
+
+void pa_route_insert(pa_route_build_t* root, const pa_route_t* route, vector<string>& names) {
+    const string pattern(route->pattern.data(), route->pattern.size());
+    pa_route_build_t* node = root;
+    size_t i = 0;
+    while(i < pattern.size()) {
+        size_t j = i;
+        while(j < pattern.size() && pattern[j] != ':' && pattern[j] != '*') j++;
+        node = pa_route_insert_static(node, pattern.substr(i, j - i));
+        if(j == pattern.size()) {
+            break;
+        }
+        size_t k = j + 1;
+        while(k < pattern.size() && pattern[k] != '/') k++;
+        names.push_back(pattern.substr(j + 1, k - j - 1));
+        if(pattern[j] == ':') {
+            if(!node->param) node->param = new pa_route_build_t;
+            node = node->param;
+        } else {
+            if(!node->wildcard) node->wildcard = new pa_route_build_t;
+            node = node->wildcard;
+        }
+        i = k;
+    }
+    node->routes.push_back(route);
+}
+
+uint32_t pa_router_text(pa_router_t* r, const char* s, size_t length) {
+    uint32_t at = r->text.size();
+    r->text.append(s, length);
+    return at;
+}
+
+void pa_router_compile(pa_router_t* r) {
+    pa_route_build_t root;
+    vector<vector<string>> names(r->routes.size());
+    for(size_t i = 0; i < r->routes.size(); i++) {
+        pa_route_insert(&root, &r->routes[i], names[i]);
+    }
+
+    r->nodes.clear();
+    r->handlers.clear();
+    r->names.clear();
+    r->text.clear();
+
+    // Breadth first, so the children of a node get consecutive numbers.
+    deque<pair<pa_route_build_t*, uint32_t>> pending;
+    r->nodes.push_back(pa_route_node_t());
+    pending.push_back(make_pair(&root, 0));
+    while(!pending.empty()) {
+        pa_route_build_t* b = pending.front().first;
+        uint32_t n = pending.front().second;
+        pending.pop_front();
+
+        pa_route_node_t node;
+        node.prefix = pa_router_text(r, b->prefix.data(), b->prefix.size());
+        node.prefix_length = b->prefix.size();
+        sort(b->children.begin(), b->children.end(), [](pa_route_build_t* x, pa_route_build_t* y) {
+            return x->prefix[0] < y->prefix[0];
+        });
+        node.first_child = r->nodes.size();
+        node.children = b->children.size();
+        for(size_t i = 0; i < b->children.size(); i++) {
+            pending.push_back(make_pair(b->children[i], (uint32_t)r->nodes.size()));
+            r->nodes.push_back(pa_route_node_t());
+        }
+        node.param = node.wildcard = -1;
+        if(b->param) {
+            node.param = r->nodes.size();
+            pending.push_back(make_pair(b->param, (uint32_t)r->nodes.size()));
+            r->nodes.push_back(pa_route_node_t());
+        }
+        if(b->wildcard) {
+            node.wildcard = r->nodes.size();
+            pending.push_back(make_pair(b->wildcard, (uint32_t)r->nodes.size()));
+            r->nodes.push_back(pa_route_node_t());
+        }
+        node.first_handler = r->handlers.size();
+        node.handlers = b->routes.size();
+        for(size_t i = 0; i < b->routes.size(); i++) {
+            const pa_route_t* route = b->routes[i];
+            vector<string>& route_names = names[route - &r->routes[0]];
+            pa_route_handler_t h;
+            h.method = pa_router_text(r, route->method.data(), route->method.size());
+            h.method_length = route->method.size();
+            h.first_name = r->names.size();
+            h.names = route_names.size();
+            h.handler = route->handler;
+            for(size_t j = 0; j < route_names.size(); j++) {
+                pa_route_span_t s = {pa_router_text(r, route_names[j].data(), route_names[j].size()), (uint32_t)route_names[j].size()};
+                r->names.push_back(s);
+            }
+            r->handlers.push_back(h);
+        }
+        r->nodes[n] = node;
+    }
+    r->dirty = false;
+}
+
+struct pa_route_match_t {
+    pa_router_t* r;
+    const char* path;
+    const char* end;
+    const char* method;
+    size_t method_length;
+    pa_route_span_t spans[32];
+    size_t depth;
+    bool path_matched; // A route had the path, though not the method.
+};
+
+// The handler for the method at node i, if the node ends a route.
+const pa_route_handler_t* pa_route_accept(pa_route_match_t& m, uint32_t i) {
+    const pa_route_node_t& node = m.r->nodes[i];
+    const pa_route_handler_t* any = NULL;
+    for(uint32_t h = node.first_handler; h < node.first_handler + node.handlers; h++) {
+        const pa_route_handler_t& x = m.r->handlers[h];
+        const char* method = m.r->text.data() + x.method;
+        if(x.method_length == m.method_length && memcmp(method, m.method, x.method_length) == 0) {
+            return &x;
+        } else if(x.method_length == 1 && method[0] == '*') {
+            any = &x;
+        }
+    }
+    if(node.handlers && !any) {
+        m.path_matched = true;
+    }
+    return any;
+}
+
+// Matches the path from p on against the children of node i, whose own
+// text is already consumed.
+const pa_route_handler_t* pa_route_lookup(pa_route_match_t& m, uint32_t i, const char* p) {
+    const pa_route_node_t& node = m.r->nodes[i];
+    const pa_route_handler_t* h;
+    if(p == m.end) {
+        if((h = pa_route_accept(m, i))) {
+            return h;
+        }
+    } else {
+        const char* text = m.r->text.data();
+        for(uint32_t c = node.first_child; c < node.first_child + node.children; c++) {
+            const pa_route_node_t& child = m.r->nodes[c];
+            const char* prefix = text + child.prefix;
+            if(prefix[0] > *p) {
+                break;
+            }
+            if(prefix[0] == *p) {
+                if((size_t)(m.end - p) >= child.prefix_length && memcmp(prefix, p, child.prefix_length) == 0 &&
+                        (h = pa_route_lookup(m, c, p + child.prefix_length))) {
+                    return h;
+                }
+                break;
+            }
+        }
+        if(node.param >= 0 && *p != '/' && m.depth < 32) {
+            const char* q = p;
+            while(q < m.end && *q != '/') q++;
+            m.spans[m.depth].offset = p - m.path;
+            m.spans[m.depth].length = q - p;
+            m.depth++;
+            if((h = pa_route_lookup(m, node.param, q))) {
+                return h;
+            }
+            m.depth--;
+        }
+    }
+    if(node.wildcard >= 0 && m.depth < 32) {
+        m.spans[m.depth].offset = p - m.path;
+        m.spans[m.depth].length = m.end - p;
+        m.depth++;
+        if((h = pa_route_accept(m, node.wildcard))) {
+            return h;
+        }
+        m.depth--;
+    }
+    return NULL;
+}
+
+pa_router_t* pa_router_argument(pa_list_t& args, pa_dict_t& kwargs, const char* fn) {
+    pa_value_t* table = pa_get_argument(args, kwargs, 0, "table", pa_new_nil());
+    if(table->type != pa_integer || !table->value.ptr) {
+        throw pa_new_exception(_TypeMismatchException, fn);
+    }
+    return (pa_router_t*)table->value.ptr;
+}
+
+pa_value_t* __table(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_router_t* r = new pa_router_t;
+    r->dirty = true;
+    return pa_new_integer((int64_t)r);
+}
+
+pa_value_t* __add(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_router_t* r = pa_router_argument(args, kwargs, "router.add");
+    pa_value_t* method = pa_get_argument(args, kwargs, 1, "method", pa_new_nil());
+    pa_value_t* pattern = pa_get_argument(args, kwargs, 2, "pattern", pa_new_nil());
+    pa_value_t* handler = pa_get_argument(args, kwargs, 3, "handler", pa_new_nil());
+    if(method->type != pa_string || pattern->type != pa_string) {
+        throw pa_new_exception(_TypeMismatchException, "router.add");
+    }
+    const pa_string_t* p = PV2STR(pattern);
+    const char* star = (const char*)memchr(p->data(), '*', p->size());
+    if(star && memchr(star, '/', p->data() + p->size() - star)) {
+        throw pa_new_exception(_TypeMismatchException, "router.add: a wildcard has to end the pattern");
+    }
+    pa_route_t route = {*PV2STR(method), *p, handler};
+    lock_guard<mutex> guard(r->lock);
+    r->routes.push_back(route);
+    r->dirty = true;
+    return pa_new_nil();
+}
+
+// Builds the lookup tables now instead of on the next match.
+pa_value_t* __compile(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_router_t* r = pa_router_argument(args, kwargs, "router.compile");
+    lock_guard<mutex> guard(r->lock);
+    pa_router_compile(r);
+    return pa_new_integer(r->nodes.size());
+}
+
+// [200, handler, parameters] for the route of the method and the path,
+// [405, nil, {}] if only other methods have the path, [404, nil, {}] if
+// no route has it. The query string is not part of the path.
+pa_value_t* __match(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_router_t* r = pa_router_argument(args, kwargs, "router.match");
+    pa_value_t* method = pa_get_argument(args, kwargs, 1, "method", pa_new_nil());
+    pa_value_t* path = pa_get_argument(args, kwargs, 2, "path", pa_new_nil());
+    if(method->type != pa_string || path->type != pa_string) {
+        throw pa_new_exception(_TypeMismatchException, "router.match");
+    }
+    if(r->dirty) {
+        lock_guard<mutex> guard(r->lock);
+        if(r->dirty) pa_router_compile(r);
+    }
+
+    pa_route_match_t m;
+    const pa_string_t* s = PV2STR(path);
+    m.r = r;
+    m.path = s->data();
+    m.end = (const char*)memchr(m.path, '?', s->size());
+    if(!m.end) m.end = m.path + s->size();
+    m.method = PV2STR(method)->data();
+    m.method_length = PV2STR(method)->size();
+    m.depth = 0;
+    m.path_matched = false;
+
+    const pa_route_handler_t* h = pa_route_lookup(m, 0, m.path);
+    pa_value_t* params = pa_new_dictionary();
+    if(!h) {
+        return pa_new_list(pa_new_integer(m.path_matched ? 405 : 404), pa_new_nil(), params);
+    }
+    pa_dict_t* d = PV2MAP(params);
+    for(uint32_t i = 0; i < h->names && i < m.depth; i++) {
+        const pa_route_span_t& name = r->names[h->first_name + i];
+        (*d)[pa_string_t(r->text.data() + name.offset, name.length)] = pa_new_string(pa_string_t(m.path + m.spans[i].offset, m.spans[i].length));
+    }
+    return pa_new_list(pa_new_integer(200), h->handler, params);
+}
+
+extern "C" pa_value_t* PA_INIT() {
+    return pa_new_dictionary(
+        pa_new_dictionary_kv(pa_new_string("table"), pa_new_function(__table)),
+        pa_new_dictionary_kv(pa_new_string("add"), pa_new_function(__add)),
+        pa_new_dictionary_kv(pa_new_string("compile"), pa_new_function(__compile)),
+        pa_new_dictionary_kv(pa_new_string("match"), pa_new_function(__match))
+    );
+}
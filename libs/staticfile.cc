@@ -0,0 +1,332 @@
+#include <palang.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Static file responses straight to a socket.
+//
+// Opened files stay in a cache keyed by path, with their response headers
+// already formatted. Files up to PA_STATIC_HOT_SIZE are kept in memory
+// together with the headers and go out in one send(); larger ones go from
+// the cached descriptor through sendfile(2), so their content never passes
+// through user space. Entries are dropped when inotify reports a change to
+// the file, or, without inotify, when stat() shows another inode, size or
+// mtime. Requests with a matching If-None-Match or If-Modified-Since get a
+// 304 without a body.
+
+#ifndef PA_STATIC_HOT_SIZE
+#define PA_STATIC_HOT_SIZE (64 << 10)
+#endif
+#ifndef PA_STATIC_HOT_TOTAL
+#define PA_STATIC_HOT_TOTAL (32 << 20)
+#endif
+#ifndef PA_STATIC_MAX_FILES
+#define PA_STATIC_MAX_FILES 256
+#endif
+
+struct pa_static_entry_t {
+    string path;
+    int fd; // -1 once the content is in memory
+    int watch;
+    struct stat st;
+    string etag;
+    time_t modified;
+    string headers; // For hot files, followed by the content
+    string not_modified;
+    bool hot;
+    pa_static_entry_t() : fd(-1), watch(-1), hot(false) {}
+    ~pa_static_entry_t() { if(fd >= 0) close(fd); }
+};
+
+typedef shared_ptr<pa_static_entry_t> pa_static_entry_ptr;
+
+const char* pa_static_content_type(const string& path) {
+    static const char* types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "application/javascript"}, {".json", "application/json"},
+        {".txt", "text/plain"}, {".xml", "application/xml"}, {".svg", "image/svg+xml"},
+        {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"}, {".ico", "image/x-icon"}, {".webp", "image/webp"},
+        {".woff", "font/woff"}, {".woff2", "font/woff2"}, {".wasm", "application/wasm"},
+        {".pdf", "application/pdf"}
+    };
+    size_t dot = path.rfind('.');
+    if(dot != string::npos && path.find('/', dot) == string::npos) {
+        for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if(strcasecmp(path.c_str() + dot, types[i][0]) == 0) {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+string pa_static_http_date(time_t t) {
+    char buf[64];
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+class pa_static_cache_t {
+    public:
+        mutex lock;
+        unordered_map<string, pa_static_entry_ptr> entries;
+        unordered_map<int, vector<string>> watches; // Paths per inotify watch
+        int inotify;
+        size_t hot_bytes;
+
+        pa_static_cache_t() : hot_bytes(0) {
+            inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+
+        void drop(const string& path) {
+            auto it = entries.find(path);
+            if(it == entries.end()) return;
+            pa_static_entry_ptr e = it->second;
+            entries.erase(it);
+            if(e->hot) hot_bytes -= e->st.st_size;
+            if(e->watch >= 0) {
+                vector<string>& paths = watches[e->watch];
+                paths.erase(remove(paths.begin(), paths.end(), path), paths.end());
+                if(paths.empty()) {
+                    watches.erase(e->watch);
+                    inotify_rm_watch(inotify, e->watch);
+                }
+            }
+        }
+
+        // Drops the entries of every file inotify reported a change to.
+        void poll() {
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t n;
+            while((n = read(inotify, buf, sizeof(buf))) > 0) {
+                for(char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+                    auto it = watches.find(((struct inotify_event*)p)->wd);
+                    if(it == watches.end()) continue;
+                    vector<string> paths = it->second;
+                    for(size_t i = 0; i < paths.size(); i++) drop(paths[i]);
+                }
+            }
+        }
+
+        bool fresh(const pa_static_entry_t& e) {
+            struct stat st;
+            return stat(e.path.c_str(), &st) == 0 && st.st_ino == e.st.st_ino && st.st_dev == e.st.st_dev &&
+                st.st_size == e.st.st_size && st.st_mtim.tv_sec == e.st.st_mtim.tv_sec && st.st_mtim.tv_nsec == e.st.st_mtim.tv_nsec;
+        }
+
+        pa_static_entry_ptr open_entry(const string& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0) return pa_static_entry_ptr();
+            pa_static_entry_ptr e = make_shared<pa_static_entry_t>();
+            e->path = path;
+            e->fd = fd;
+            if(fstat(fd, &e->st) || !S_ISREG(e->st.st_mode)) return pa_static_entry_ptr();
+
+            char etag[64];
+            snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx%09lx\"", (unsigned long)e->st.st_ino, (unsigned long)e->st.st_size,
+                    (unsigned long)e->st.st_mtim.tv_sec, (unsigned long)e->st.st_mtim.tv_nsec);
+            e->etag = etag;
+            e->modified = e->st.st_mtim.tv_sec;
+            string validators = "Last-Modified: " + pa_static_http_date(e->modified) + "\r\nETag: " + e->etag + "\r\n";
+            e->headers = "HTTP/1.1 200 OK\r\nContent-Type: " + string(pa_static_content_type(path)) +
+                "\r\nContent-Length: " + to_string((long long)e->st.st_size) + "\r\n" + validators + "Connection: close\r\n\r\n";
+            e->not_modified = "HTTP/1.1 304 Not Modified\r\n" + validators + "Connection: close\r\n\r\n";
+
+            if(e->st.st_size <= PA_STATIC_HOT_SIZE && hot_bytes + e->st.st_size <= PA_STATIC_HOT_TOTAL) {
+                size_t header_size = e->headers.size();
+                e->headers.resize(header_size + e->st.st_size);
+                off_t done = 0;
+                while(done < e->st.st_size) {
+                    ssize_t n = pread(fd, &e->headers[header_size + done], e->st.st_size - done, done);
+                    if(n <= 0) break;
+                    done += n;
+                }
+                if(done == e->st.st_size) {
+                    e->hot = true;
+                    hot_bytes += e->st.st_size;
+                    close(e->fd);
+                    e->fd = -1;
+                } else {
+                    e->headers.resize(header_size);
+                }
+            }
+            return e;
+        }
+
+        // The entry for path, opened or revalidated as needed.
+        pa_static_entry_ptr get(const string& path) {
+            lock_guard<mutex> guard(lock);
+            if(inotify >= 0) {
+                poll();
+            }
+            auto it = entries.find(path);
+            if(it != entries.end()) {
+                if(inotify >= 0 || fresh(*it->second)) {
+                    return it->second;
+                }
+                drop(path);
+            }
+            pa_static_entry_ptr e = open_entry(path);
+            if(!e) {
+                return e;
+            }
+            if(entries.size() >= PA_STATIC_MAX_FILES) {
+                drop(entries.begin()->first);
+            }
+            if(inotify >= 0) {
+                e->watch = inotify_add_watch(inotify, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+                if(e->watch >= 0) {
+                    watches[e->watch].push_back(path);
+                } else {
+                    return e; // Served, but not cached without a way to see changes.
+                }
+            }
+            entries[path] = e;
+            return e;
+        }
+};
+
+inline pa_static_cache_t& pa_static_cache() {
+    static pa_static_cache_t* cache = new pa_static_cache_t;
+    return *cache;
+}
+
+// The value of a request header, without surrounding blanks.
+bool pa_static_header(const pa_string_t& request, const char* name, string& value) {
+    size_t length = strlen(name);
+    size_t at = request.find('\n');
+    while(at != pa_string_t::npos && at + 1 < request.size()) {
+        const char* line = request.data() + at + 1;
+        size_t end = request.find('\n', at + 1);
+        size_t size = (end == pa_string_t::npos ? request.size() : end) - (at + 1);
+        if(size > length && line[length] == ':' && strncasecmp(line, name, length) == 0) {
+            size_t i = length + 1;
+            while(i < size && (line[i] == ' ' || line[i] == '\t')) i++;
+            while(size > i && (line[size - 1] == '\r' || line[size - 1] == ' ')) size--;
+            value.assign(line + i, size - i);
+            return true;
+        }
+        at = end;
+    }
+    return false;
+}
+
+bool pa_static_not_modified(const pa_string_t& request, const pa_static_entry_t& e) {
+    string value;
+    if(pa_static_header(request, "If-None-Match", value)) {
+        size_t i = 0;
+        while(i < value.size()) {
+            size_t j = value.find(',', i);
+            if(j == string::npos) j = value.size();
+            string tag = value.substr(i, j - i);
+            tag.erase(0, tag.find_first_not_of(" \t"));
+            tag.erase(tag.find_last_not_of(" \t") + 1);
+            if(tag.compare(0, 2, "W/") == 0) tag.erase(0, 2);
+            if(tag == "*" || tag == e.etag) {
+                return true;
+            }
+            i = j + 1;
+        }
+        return false; // If-Modified-Since only counts without If-None-Match.
+    }
+    if(pa_static_header(request, "If-Modified-Since", value)) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end = strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return end && e.modified <= timegm(&tm);
+    }
+    return false;
+}
+
+bool pa_static_send(int sock, const char* data, size_t size, int flags) {
+    while(size) {
+        ssize_t n = send(sock, data, size, flags | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Maps the path of a request under root: the query string is cut off and
+// `..` segments are refused. A directory path gets index.html.
+bool pa_static_resolve(const pa_string_t& root, const pa_string_t& path, string& out) {
+    size_t end = path.find('?');
+    string p(path.data(), end == pa_string_t::npos ? path.size() : end);
+    if(p.find('\0') != string::npos) return false;
+    for(size_t i = 0; i < p.size();) {
+        size_t j = p.find('/', i);
+        if(j == string::npos) j = p.size();
+        if(j - i == 2 && p[i] == '.' && p[i + 1] == '.') return false;
+        i = j + 1;
+    }
+    out.assign(root.data(), root.size());
+    if(!out.empty() && out[out.size() - 1] != '/' && (p.empty() || p[0] != '/')) out += '/';
+    out += p;
+    if(p.empty() || p[p.size() - 1] == '/') out += "index.html";
+    return true;
+}
+
+// serve(socket, root, path, request) sends the file at root/path as the
+// whole response to the request (its raw text) and returns the status:
+// 200, 304, or 404 when there is no such file, in which case nothing was
+// sent. HEAD requests get the headers only.
+pa_value_t* __serve(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* socket = pa_get_argument(args, kwargs, 0, "socket", pa_new_nil());
+    pa_value_t* root = pa_get_argument(args, kwargs, 1, "root", pa_new_nil());
+    pa_value_t* path = pa_get_argument(args, kwargs, 2, "path", pa_new_nil());
+    pa_value_t* request = pa_get_argument(args, kwargs, 3, "request", pa_new_string(""));
+    if(socket->type != pa_integer || root->type != pa_string || path->type != pa_string || request->type != pa_string) {
+        throw pa_new_exception(_TypeMismatchException, "staticfile.serve");
+    }
+    int sock = socket->value.i32;
+    const pa_string_t& req = *PV2STR(request);
+
+    string file;
+    pa_static_entry_ptr e;
+    if(!pa_static_resolve(*PV2STR(root), *PV2STR(path), file) || !(e = pa_static_cache().get(file))) {
+        return pa_new_integer(404);
+    }
+    if(pa_static_not_modified(req, *e)) {
+        pa_static_send(sock, e->not_modified.data(), e->not_modified.size(), 0);
+        return pa_new_integer(304);
+    }
+    bool head = req.compare(0, 5, "HEAD ") == 0;
+    size_t header_size = e->hot ? e->headers.size() - e->st.st_size : e->headers.size();
+    if(head || e->hot) {
+        pa_static_send(sock, e->headers.data(), head ? header_size : e->headers.size(), 0);
+        return pa_new_integer(200);
+    }
+    if(!pa_static_send(sock, e->headers.data(), header_size, MSG_MORE)) {
+        return pa_new_integer(200);
+    }
+    off_t offset = 0;
+    while(offset < e->st.st_size) {
+        ssize_t n = sendfile(sock, e->fd, &offset, e->st.st_size - offset);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+    }
+    return pa_new_integer(200);
+}
+
+extern "C" pa_value_t* PA_INIT() {
+    return pa_new_dictionary(
+        pa_new_dictionary_kv(pa_new_string("serve"), pa_new_function(__serve))
+    );
+}
@@ -39,8 +39,34 @@ pa_value_t* _read(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
     char* buffer = (char*)GC_MALLOC(1024);
     int sock = socket->value.i32;
     
-    recv(sock, buffer, 1024, 0);
-    return pa_new_string(pa_string_t(buffer));  
+    ssize_t szRead = recv(sock, buffer, 1024, 0);
+    return pa_new_string(pa_string_t(buffer, szRead > 0 ? szRead : 0));  
+}
+
+// What the peer sends, a chunk of up to PA_TCP_CHUNK bytes per item, until
+// it closes the connection.
+#ifndef PA_TCP_CHUNK
+#define PA_TCP_CHUNK 16384
+#endif
+
+class pa_socket_chunks_t : public pa_sequence_data {
+    public:
+        int sock;
+        char* buffer;
+        pa_socket_chunks_t(int sock) : sock(sock), buffer((char*)GC_MALLOC_ATOMIC(PA_TCP_CHUNK)) {}
+        bool next(pa_value_t*& v) {
+            ssize_t szRead = recv(this->sock, this->buffer, PA_TCP_CHUNK, 0);
+            if(szRead <= 0) {
+                return false;
+            }
+            v = pa_new_string(pa_string_t(this->buffer, szRead));
+            return true;
+        }
+};
+
+pa_value_t* _chunks(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
+    pa_value_t* socket = pa_get_argument(args, kwargs, 0, "socket", pa_new_nil());
+    return pa_new_sequence(new pa_socket_chunks_t(socket->value.i32));
 }
 
 pa_value_t* _write(pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) {
@@ -92,6 +118,7 @@ extern "C" pa_value_t* PA_INIT() {
         pa_new_dictionary_kv(pa_new_string("socket"), pa_new_function(_socket)),
         pa_new_dictionary_kv(pa_new_string("connect"), pa_new_function(_connect)),
         pa_new_dictionary_kv(pa_new_string("read"), pa_new_function(_read)),
+        pa_new_dictionary_kv(pa_new_string("chunks"), pa_new_function(_chunks)),
         pa_new_dictionary_kv(pa_new_string("write"), pa_new_function(_write)),
         pa_new_dictionary_kv(pa_new_string("listen"), pa_new_function(_listen)),
         pa_new_dictionary_kv(pa_new_string("accept"), pa_new_function(_accept)),
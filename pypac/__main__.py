@@ -1,10 +1,12 @@
 import sys, os, subprocess, pprint
-from tempfile import NamedTemporaryFile
+from tempfile import NamedTemporaryFile, mkdtemp
 from optparse import OptionParser
-import parser, compiler
+from multiprocessing import Pool, cpu_count
+import shutil
+import parser, optimizer, compiler, linker, cache
 
 CXX = os.environ.get("CXX", "c++")
-CXXFLAGS = os.environ.get("CXXFLAGS", "-O3 -g -std=c++11 -ldl -lgc")
+CXXFLAGS = os.environ.get("CXXFLAGS", "-O3 -g -std=c++11 -pthread -ldl -lgc")
 PA_HOME = os.path.abspath(os.environ.get("PA_HOME", "."))
 
 pp = pprint.PrettyPrinter(indent=2,width=80)
@@ -15,6 +17,11 @@ opt.add_option("-v", "--verbose", dest="verbose", default=False, help="verbose m
 opt.add_option("-c", "--cpp", dest="cpp", default=False, help="generate a C++ source code file instead of an executable.", action="store_true")
 opt.add_option("-s", "--static", dest="static", default=False, help="link C++ runtime libraries statically.", action="store_true")
 opt.add_option("-l", "--library", dest="library", default=False, help="build as a library.", action="store_true")
+opt.add_option("-b", "--bundle", dest="bundle", default=False, help="link imported modules into the output instead of loading them at runtime.", action="store_true")
+opt.add_option("-j", "--jobs", dest="jobs", default=cpu_count(), type="int", help="number of module sources compiled in parallel with -b.", metavar="N")
+opt.add_option("-O", dest="optimize", default=1, type="int", help="optimization level: 0 none, 1 constant folding, dead code removal and a constant pool (default), 2 also common subexpressions and loop-invariant hoisting.", metavar="LEVEL")
+opt.add_option("--profile", dest="profile", default=False, help="count calls and time per Pa function; the report goes to stderr at exit and the stacks to $PA_PROFILE_OUT (default: pa-profile.folded).", action="store_true")
+opt.add_option("--no-cache", dest="cache", default=True, help="don't reuse or store build results. (cache directory: $PA_CACHE or ~/.cache/pypac)", action="store_false")
 
 options, args = opt.parse_args()
 
@@ -22,20 +29,116 @@ if len(args) == 0:
     opt.print_help()
     exit(1)
 
-cpp_source = ""
-source = ""
-for x in args:
-    if x.split('.')[-1][0] == 'c':
-        cpp_source += open(x).read() + "\n"
-    elif x.split('.')[-1] == 'pa':
-        source += open(x).read() + "\n"
+build_cache = cache.BuildCache(enabled=options.cache)
 
-ast = parser.parse(source)
-if options.verbose: pp.pprint(eval(str(ast)))
+def compile_sources(paths, is_library, verbose=False):
+    cpp_source = ""
+    source = ""
+    sources = [] # (first line, path) of each Pa file
+    for x in paths:
+        if x.split('.')[-1][0] == 'c':
+            cpp_source += open(x).read() + "\n"
+        elif x.split('.')[-1] == 'pa':
+            sources.append((source.count("\n") + 1, x))
+            source += open(x).read() + "\n"
 
-cxx = cpp_source
-if source:
-    cxx += compiler.compile(ast, is_library=options.library)
+    key = build_cache.key("cxx", build_cache.version, str(is_library), str(options.optimize), cpp_source, source, repr(sources))
+    cached = build_cache.get_source(key)
+    if cached:
+        return cached
+
+    cxx = cpp_source
+    imports = []
+    if source:
+        ast = optimizer.optimize(parser.parse(source), options.optimize)
+        if verbose: pp.pprint(eval(str(ast)))
+        c = compiler.Compiler(ast, is_library=is_library, sources=sources, constants=options.optimize >= 1)
+        cxx += c.compile()
+        imports = [x[0] for x in c.imports]
+    build_cache.put_source(key, cxx, imports)
+    return cxx, imports
+
+def compile_library(path):
+    """compile_sources for one module, in a worker process. The cache
+    counters go back with the result, to be added to this process'."""
+    build_cache.stats = {}
+    return compile_sources([path], True), build_cache.stats
+
+def compile_libraries(paths):
+    if options.jobs < 2 or len(paths) < 2:
+        return [compile_sources([x], True) for x in paths]
+    # Processes rather than threads: generating C++ holds the GIL.
+    pool = Pool(min(options.jobs, len(paths)))
+    try:
+        results = pool.map(compile_library, paths)
+    finally:
+        pool.close()
+    for _, stats in results:
+        build_cache.merge(stats)
+    return [x[0] for x in results]
+
+def run(cmdline):
+    if options.verbose: print " ".join(cmdline)
+    p = subprocess.Popen(cmdline, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = p.communicate()
+    if options.verbose and err: print err
+    return p.returncode
+
+def is_gcc():
+    try:
+        p = subprocess.Popen([CXX, "--version"], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, _ = p.communicate()
+        return "clang" not in out.lower()
+    except OSError:
+        return False
+
+def build_pch(compile_flags):
+    """Precompiles palang.h with the exact flags of this build. Returns the
+    directory to put in front of the include path, or None."""
+    if not options.cache or not is_gcc():
+        return None
+    header = os.path.join(PA_HOME, "include", "palang.h")
+    key = build_cache.key("pch", CXX, compile_flags, cache.read(header))
+    pch = build_cache.get_object(key, "pch", ".d/palang.h.gch")
+    if pch:
+        return os.path.dirname(pch)
+    target = build_cache.object_path(key, "pch", ".d/palang.h.gch")
+    tmp = mkdtemp()
+    built = os.path.join(tmp, "palang.h.gch")
+    if run([CXX, "-x", "c++-header", header, "-o", built] + compile_flags.split()):
+        shutil.rmtree(tmp)
+        return None # Not fatal, the build just goes without it.
+    if not os.path.isdir(os.path.dirname(target)):
+        os.makedirs(os.path.dirname(target))
+    build_cache.put_object(key, built, "pch", ".d/palang.h.gch")
+    shutil.rmtree(tmp)
+    return os.path.dirname(target)
+
+def compile_unit(cxx, compile_flags, workdir):
+    """Compiles the translation unit into an object file, through the cache."""
+    key = build_cache.key("obj", CXX, compile_flags, cache.read(os.path.join(PA_HOME, "include", "palang.h")), cxx)
+    obj = build_cache.get_object(key)
+    if obj:
+        return obj
+    f = NamedTemporaryFile(suffix='.cc', dir=workdir, delete=False)
+    f.write(cxx)
+    f.close()
+    obj = f.name[:-3] + ".o"
+    ret = run([CXX, "-c", f.name, "-o", obj] + compile_flags.split())
+    os.unlink(f.name)
+    if ret:
+        return None
+    if options.cache:
+        return build_cache.put_object(key, obj)
+    return obj
+
+cxx, imports = compile_sources(args, options.library, verbose=options.verbose)
+
+if options.bundle:
+    modules = linker.resolve(imports, compile_libraries, PA_HOME)
+    if options.verbose:
+        for name, path, _ in modules: print "Linking", name, "from", path
+    cxx = linker.link(cxx, modules)
 
 if options.cpp:
     if options.output is None:
@@ -45,9 +148,6 @@ if options.cpp:
             options.output = args[0] + '.cc'
     open(options.output, 'w').write(cxx)
 else:
-    f = NamedTemporaryFile(suffix='.cc', delete=False)
-    f.write(cxx)
-    f.close()
     if options.output is None:
         if options.library:
             try:
@@ -56,17 +156,32 @@ else:
                 options.output = args[0] + '.so'
         else:
             options.output = args[0][:-3]
-    CXXFLAGS += " -o " + options.output + " "
-    CXXFLAGS += " -I " + PA_HOME + "/include/ "
+    # Linker options stay out of the compile step; gcc would otherwise try
+    # to link the precompiled header.
+    compile_flags = " ".join([x for x in CXXFLAGS.split() if not x.startswith(("-l", "-L", "-Wl,"))])
+    compile_flags += " -I " + PA_HOME + "/include/ "
+    if options.profile:
+        compile_flags += " -DPA_PROFILE "
+    link_flags = CXXFLAGS + " -o " + options.output + " "
     if options.library:
-        CXXFLAGS += " -fPIC -shared "
+        compile_flags += " -fPIC "
+        link_flags += " -fPIC -shared "
+    else:
+        # Runtime singletons (stdout buffer, thread pool, scheduler) are
+        # exported so dlopen'ed modules share the executable's instances.
+        link_flags += " -rdynamic "
     if options.static:
-        CXXFLAGS += " -static-libgcc -static-libstdc++ "
-    cmdline = (CXX + " " + f.name + " "  + CXXFLAGS).split()
-    if options.verbose: print " ".join(cmdline)
-    p = subprocess.Popen(cmdline, stderr=subprocess.PIPE)
-    ret = p.wait()
-    err = p.stderr.read()
-    os.unlink(f.name)
-    if ret: print 'Internal Error!'
-    if options.verbose and err: print err
+        link_flags += " -static-libgcc -static-libstdc++ "
+
+    pch_dir = build_pch(compile_flags)
+    if pch_dir:
+        compile_flags = " -I " + pch_dir + " " + compile_flags
+
+    workdir = mkdtemp()
+    obj = compile_unit(cxx, compile_flags, workdir)
+    if obj is None or run([CXX, obj] + link_flags.split()):
+        print 'Internal Error!'
+        shutil.rmtree(workdir)
+        exit(1)
+    shutil.rmtree(workdir)
+    if options.verbose and options.cache: print build_cache.report()
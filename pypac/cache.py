@@ -0,0 +1,89 @@
+import os, hashlib, json, shutil, tempfile
+
+# Bumping the sources of pypac itself invalidates the C++ it generated.
+PYPAC_DIR = os.path.dirname(os.path.abspath(__file__))
+
+def default_dir():
+    return os.environ.get("PA_CACHE", os.path.join(os.path.expanduser("~"), ".cache", "pypac"))
+
+def digest(*parts):
+    h = hashlib.sha1()
+    for x in parts:
+        h.update(str(len(x)) + ":" + x)
+    return h.hexdigest()
+
+def read(path):
+    with open(path) as f:
+        return f.read()
+
+class BuildCache:
+    """Content-addressed store for generated C++, compiled objects and the
+    precompiled runtime header. Keys are hashes of everything that goes
+    into an artifact, so stale entries are never reused; they only take
+    disk space until the directory is cleared."""
+    def __init__(self, path=None, enabled=True):
+        self.path = path or default_dir()
+        self.enabled = enabled
+        self.stats = {}
+        self.version = digest(*[read(os.path.join(PYPAC_DIR, x)) for x in sorted(os.listdir(PYPAC_DIR)) if x.endswith(".py")])
+    def _count(self, kind, hit):
+        h, m = self.stats.get(kind, (0, 0))
+        self.stats[kind] = (h + 1, m) if hit else (h, m + 1)
+    def _entry(self, kind, key, suffix=""):
+        d = os.path.join(self.path, kind, key[:2])
+        if not os.path.isdir(d):
+            try:
+                os.makedirs(d)
+            except OSError:
+                pass # Created by a parallel build.
+        return os.path.join(d, key + suffix)
+    def _store(self, target, write):
+        # Written next to the target and renamed, so readers never see a
+        # partial entry.
+        fd, tmp = tempfile.mkstemp(dir=os.path.dirname(target))
+        os.close(fd)
+        write(tmp)
+        os.rename(tmp, target)
+    def key(self, *parts):
+        return digest(*parts)
+    def get_source(self, key):
+        """Generated C++ and the list of imports, or None."""
+        if not self.enabled:
+            return None
+        path = self._entry("cxx", key, ".json")
+        hit = os.path.isfile(path)
+        self._count("cxx", hit)
+        if hit:
+            entry = json.loads(read(path))
+            return entry["cxx"].encode("utf-8"), [x.encode("utf-8") for x in entry["imports"]]
+        return None
+    def put_source(self, key, cxx, imports):
+        if self.enabled:
+            data = json.dumps({"cxx": cxx.decode("utf-8"), "imports": imports})
+            self._store(self._entry("cxx", key, ".json"), lambda tmp: open(tmp, "w").write(data))
+    def object_path(self, key, kind="obj", suffix=".o"):
+        return self._entry(kind, key, suffix)
+    def get_object(self, key, kind="obj", suffix=".o"):
+        """Path of a cached artifact, or None."""
+        if not self.enabled:
+            return None
+        path = self.object_path(key, kind, suffix)
+        hit = os.path.isfile(path)
+        self._count(kind, hit)
+        return path if hit else None
+    def put_object(self, key, built, kind="obj", suffix=".o"):
+        if self.enabled:
+            self._store(self.object_path(key, kind, suffix), lambda tmp: shutil.copyfile(built, tmp))
+        return self.object_path(key, kind, suffix)
+    def merge(self, stats):
+        for kind, (h, m) in stats.items():
+            sh, sm = self.stats.get(kind, (0, 0))
+            self.stats[kind] = (sh + h, sm + m)
+    def report(self):
+        names = {"cxx": "generated C++", "obj": "objects", "pch": "precompiled header"}
+        lines = []
+        for kind in ["cxx", "pch", "obj"]:
+            if kind in self.stats:
+                h, m = self.stats[kind]
+                lines.append("  %-20s %d hit(s), %d miss(es)" % (names[kind] + ":", h, m))
+        return "Build cache (" + self.path + "):\n" + "\n".join(lines)
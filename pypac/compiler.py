@@ -1,12 +1,18 @@
+import json
+
 class CppGenerator:
     HEADER = "/* Automatically compiled from Pa language */\n#include <palang.h>"
     ENTRYPOINT = "int main(int argc,char**argv,char**env){PA_ENTER(argc,argv,env);return PA_LEAVE(PA_INIT());}"
-    def finalize(self, code, has_entrypoint=True):
-        return "%s\nextern \"C\" pa_value_t* PA_INIT(){try{pa_value_t* _this=pa_new_nil();INTRINSICS();%s;}catch(pa_value_t*ex){pa_print_value(ex);}};%s" % (CppGenerator.HEADER, code, CppGenerator.ENTRYPOINT if has_entrypoint else "")
+    def finalize(self, code, has_entrypoint=True, functions="", prologue=""):
+        return "%s\n%s\nextern \"C\" pa_value_t* PA_INIT(){static pa_value_t* _module=NULL;if(_module)return _module;%stry{pa_value_t* _this=pa_new_nil();INTRINSICS();%s;}catch(pa_value_t*ex){pa_print_value(ex);}return pa_new_nil();};\n%s" % (CppGenerator.HEADER, functions, prologue, code, CppGenerator.ENTRYPOINT if has_entrypoint else "")
     def cfunc_call(self, name, *args):
         return name + "(" + (",".join(args)) + ")"
     def func_call(self, name, this="_this", *args, **kwargs):
-        return self.cfunc_call("pa_function_call", name, self.literal_clist(*args), self.literal_cdict(*[self.literal_cdict_kw(x,y) for x,y in kwargs]), this)
+        return self.call("pa_function_call", name, this, args, kwargs)
+    def tail_call(self, name, this="_this", *args, **kwargs):
+        return self.call("pa_tail_call", name, this, args, kwargs)
+    def call(self, fn, name, this, args, kwargs):
+        return self.cfunc_call(fn, name, self.literal_clist(*args), self.literal_cdict(*[self.literal_cdict_kv(self.literal_cstr(x), y) for x, y in kwargs.items()]), this)
     def literal_nil(self):
         return self.cfunc_call("pa_new_nil")
     def literal_bool(self, v):
@@ -14,11 +20,15 @@ class CppGenerator:
     def literal_int(self, v):
         return self.cfunc_call("pa_new_integer", str(v))
     def literal_real(self, v):
-        return self.cfunc_call("pa_new_real", str(v))
+        return self.cfunc_call("pa_new_float", str(v))
     def literal_str(self, v):
         return self.cfunc_call("pa_new_string", "\"" + v + "\"")
-    def literal_func(self, *args):
-        return self.cfunc_call("pa_new_function", "[=](pa_list_t args, pa_dict_t kwargs, pa_value_t* _this) -> pa_value_t* {" + ("".join(args)) + "}")
+    def literal_func(self, name, env=None):
+        if env is None:
+            return self.cfunc_call("pa_new_function", name)
+        return self.cfunc_call("pa_new_closure", name, env)
+    def literal_generator(self, body):
+        return self.cfunc_call("pa_new_generator_function", body)
     def literal_list(self, *args):
         return self.cfunc_call("pa_new_list", *args)
     def literal_dict_kv(self, k, v):
@@ -40,9 +50,42 @@ class CppGenerator:
     def define_member_in_class(self, n, k, v):
         return "(" + n + ")->value.cls->set_member(" + self.literal_cstr(k) + "," + v + ");"
     def define_operator_in_class(self, n, k, v):
-        return "(" + n + ")->value.cls->set_operator(" + self.literal_cstr(k) + "," + v + ");"
-    def evaluate_multiline(self, *args):
-        return "([=]() -> pa_value_t* {" + ("".join(args)) + "})()"
+        return "(" + n + ")->value.cls->set_operator(pa_op_" + OPERATOR_NAMES.get(k, k) + "," + v + ");"
+    def func_name(self, name):
+        return "pa_" + name
+    def env_type(self, n):
+        return "pa_env_%d" % (n,)
+    def env_var(self, n):
+        return "_env_%d" % (n,)
+    def temp_var(self, n):
+        return "_t%d" % (n,)
+    def define_func(self, n, name, body, captures):
+        if not captures:
+            return "static pa_value_t* %s(pa_list_t args,pa_dict_t kwargs,pa_value_t* _this){%sreturn pa_new_nil();}\n" % (name, body)
+        return "struct %s:gc{%s};static pa_value_t* %s(%s* _env,pa_list_t& args,pa_dict_t& kwargs,pa_value_t* _this){%s%sreturn pa_new_nil();}\n" % (
+                self.env_type(n), "".join(["pa_value_t* %s;" % (x,) for x in captures]),
+                name, self.env_type(n),
+                "".join(["pa_value_t* %s=_env->%s;" % (x, x) for x in captures]), body)
+    def define_env(self, n, captures):
+        return "%s* %s=new %s;" % (self.env_type(n), self.env_var(n), self.env_type(n)) + "".join([self.set_env(n, x) for x in captures])
+    def set_env(self, n, k):
+        return "%s->%s=%s;" % (self.env_var(n), k, k)
+    def line_directive(self, line, path):
+        return "\n#line %d %s\n" % (line, json.dumps(path))
+    def profile_scope(self, name, path, line):
+        return "PA_PROFILE_SCOPE(%s,%s,%d);" % (json.dumps(name), json.dumps(path), line)
+    def define_temp(self, n, v):
+        # Declared apart from the assignment: a block's `= value` may jump past it.
+        return "pa_value_t* %s;%s=%s;" % (self.temp_var(n), self.temp_var(n), v)
+    def constant_var(self, n):
+        return "_k%d" % (n,)
+    def define_constant(self, n):
+        return "static pa_value_t* %s;" % (self.constant_var(n),)
+    def set_constant(self, n, v):
+        return "%s=%s;" % (self.constant_var(n), v)
+    def evaluate_block(self, n, stats):
+        t = self.temp_var(n)
+        return "pa_value_t* %s;{%s%s=pa_new_nil();}%s_end:;" % (t, stats, t, t)
     def op(self, op, a, b=None, c=None):
         t_op = {
             'setitem': lambda: self.cfunc_call("pa_operator_setitem", a, b, c),
@@ -53,6 +96,9 @@ class CppGenerator:
             '-': lambda: self.cfunc_call("pa_operator_subtract", a, b),
             '*': lambda: self.cfunc_call("pa_operator_multiply", a, b),
             '/': lambda: self.cfunc_call("pa_operator_divide", a, b),
+            '+=': lambda: self.cfunc_call("pa_operator_add_assign", a, b),
+            '-=': lambda: self.cfunc_call("pa_operator_subtract", a, b),
+            '*=': lambda: self.cfunc_call("pa_operator_multiply", a, b),
             'mod': lambda: self.cfunc_call("pa_operator_modulo", a, b),
             'length': lambda: self.cfunc_call("pa_operator_length", a),
             '^': lambda: self.cfunc_call("pa_operator_power", a, b),
@@ -63,44 +109,52 @@ class CppGenerator:
             '<': lambda: self.cfunc_call("pa_operator_lt", a, b),
             '<=': lambda: self.cfunc_call("pa_operator_lte", a, b),
             '->': lambda: self.cfunc_call("pa_operator_right", a, b),
+            '->>': lambda: self.cfunc_call("pa_operator_parallel_right", a, b),
+            'spawn': lambda: self.cfunc_call("pa_spawn", a),
+            'await': lambda: self.cfunc_call("pa_await", a),
             '<-': lambda: self.cfunc_call("pa_operator_left", a, b),
             'and': lambda: self.cfunc_call("pa_operator_and", a, b),
             'or': lambda: self.cfunc_call("pa_operator_or", a, b)
         }
         return t_op[op]()
-    def cop(self, op, a, b=None, c=None):
-        t_op = {
-            '++': lambda: a + "++",
-            '<': lambda: a + "<" + b
-        }
-        return t_op[op]()
     def var_name(self, v):
         return "_" + v
     def define_var(self, v, V=None):
         return "pa_value_t*  " + self.var_name(v)  + (("="+V) if V else "") + ";"
-    def define_cvar(self, t, v, V=None):
-        t_type = {
-            'i64': 'int64_t'
-        }
-        return t_type[t] + " " + v + ("="+V if V else "")
-    def raw_var(self, t, name):
-        t_type = {
-            'i64': 'i64'
-        }
-        return name + "->value." + t_type[t]
     def define_param(self, v, n, kw, df):
         return "pa_value_t* " + self.var_name(v) + " = " + self.cfunc_call("pa_get_argument", "args", "kwargs", str(n), self.literal_cstr(str(kw)), str(df)) + ";"
     def stat_assign(self, n, v):
         return n + "=" + v + ";"
     def stat_import(self, v):
         return self.cfunc_call("pa_import", "\"" + str(v) + "\"")
+    def import_bindings_marker(self, site):
+        return "/*PA_BIND_%d*/" % (site,)
+    def bound_member_name(self, module, site, k):
+        return "_%s_%d_%s" % (module, site, k)
+    def define_bound_member(self, n, module, k, bind=True):
+        return "pa_value_t* " + n + "=" + (self.cfunc_call("pa_module_member", module, self.literal_cstr(k)) if bind else "NULL") + ";"
+    def bound_member(self, n, module, k):
+        return "(" + n + "?" + n + ":" + self.op("getattr", module, self.literal_cstr(k)) + ")"
     def stat_ret(self, v):
         return "return " + v + ";"
+    def stat_tail_loop(self, label, params, values):
+        # values are (temporary id, expression); all are evaluated before any parameter changes.
+        return "{" + "".join([self.define_temp(n, v) for n, v in values]) + "".join([self.stat_assign(self.var_name(x), self.temp_var(n)) for x, (n, _) in zip(params, values)]) + "goto " + label + ";}"
+    def label(self, name):
+        return name + ":;"
+    def stat_ret_block(self, n, v):
+        t = self.temp_var(n)
+        return "{" + t + "=" + v + ";goto " + t + "_end;}"
+    def stat_ret_module(self, v):
+        return "return _module=" + v + ";"
     def stat_block(self, v):
         return "{" + v + "}"
-    def stat_for(self, initial, condition, incremental, *args):
-        return "for(" + initial + ";" + condition + ";" + incremental + "){" + ("".join(args)) + "}"
-    def stat_while(self, condition, *args):
+    def stat_for(self, v, iterable, *args):
+        return "{pa_for_t _for_(" + iterable + ");" + self.define_var(v) + "while(_for_.next(" + self.var_name(v) + ")){" + ("".join(args)) + "}}"
+    def stat_while(self, condition, *args, **kwargs):
+        pre = kwargs.get("pre")
+        if pre:
+            return "while(true){" + pre + "if(!" + self.cfunc_call("pa_evaluate_into_boolean", condition) + ")break;" + ("".join(args)) + "}"
         return "while(" + (self.cfunc_call("pa_evaluate_into_boolean", condition)) + "){" + ("".join(args)) + "}" 
     def stat_if(self, condition, stats, else_stats=None):
         return "if(" + (self.cfunc_call("pa_evaluate_into_boolean", condition)) + "){" + stats + "}" + (("else{" + else_stats + "}") if else_stats else "")
@@ -110,10 +164,12 @@ class CppGenerator:
         return "continue"
     def stat_raise(self, v):
         return "throw " + v + ";"
-    def stat_try(self, _try, _excepts=[], _finally=""):
+    def stat_yield(self, v):
+        return self.cfunc_call("pa_yield", v)
+    def stat_try(self, _try, _excepts=[], _finally="", _pre=""):
         src = ""
         src += "try{%s}" % (_try,)
-        src += "catch(pa_value_t* ex){" 
+        src += "catch(pa_value_t* ex){" + _pre
         for x in _excepts:
             src += "if(pa_instanceof(ex, %s)){pa_value_t* %s=ex;%s}else " % (x[0], x[1], x[2])
         src += "{throw ex;};};{" + _finally + "}"
@@ -123,43 +179,129 @@ class CppGenerator:
     
 
 
+# Class operators in C++ symbols and pa_op_* table slots, named after the
+# runtime functions.
+OPERATOR_NAMES = {
+    '+': 'add', '-': 'subtract', '*': 'multiply', '/': 'divide', 'mod': 'modulo',
+    '==': 'eq', '!=': 'neq', '>': 'gt', '>=': 'gte', '<': 'lt', '<=': 'lte',
+    '->': 'right', '->>': 'parallel_right', '<-': 'left', '&': 'ref', '?': 'query', '!': 'bang'
+}
+
 class Compiler:
-    def __init__(self, ast, generator=CppGenerator(), exports=[], imports=[], intrinsics=["range", "print", "input", "len"], is_library=False):
+    def __init__(self, ast, generator=CppGenerator(), exports=None, imports=None, intrinsics=["range", "print", "input", "len", "str", "format", "flush", "append", "extend", "pop", "insert", "lazy", "collect", "filter", "take", "reduce"], is_library=False, sources=None, constants=False):
         self.generator = generator
         self.root = ast
-        self.exports = exports
-        self.imports = imports
-        self.intrinsics = intrinsics + ["this"] + ["DivideByZeroException", "NoSuchAttributeException", "ArgumentRequiredException", "NotHashableException", "NotCallableException", "TypeMismatchException", "ImportException"]
+        self.exports = exports if exports is not None else []
+        self.imports = imports if imports is not None else []
+        self.runtime_globals = ["this"] + ["DivideByZeroException", "NoSuchAttributeException", "ArgumentRequiredException", "OutOfIndexException", "NotHashableException", "NotCallableException", "TypeMismatchException", "ImportException"]
+        self.intrinsics = intrinsics + self.runtime_globals
         self.is_library = is_library
+        self.topmost = False
+        self.import_sites = {} # module name -> the top-level import that defined it
+        self.bindings = [] # per import site, the members referenced as `module.name`
+        self.assigned_members = set() # (module, name) pairs that are written to
+        self.functions = [] # C++ functions that closures are compiled into
+        self.contexts = [{'captures': []}] # PA_INIT, then the functions being compiled
+        self.ret_targets = [None] # None returns from the function, otherwise the block's temporary
+        self.pre = [] # Statements that have to run before the current one
+        self.last_id = 0
+        self.sources = sources # (first line, path) of each file in the source, for #line
+        self.line = 0 # Source line of the statement being compiled
+        self.names = [] # Pa names of the functions being compiled, innermost last
+        self.symbols = set()
+        self.constants = [] if constants else None # Literals created once, when the module loads
     def append(self, src):
         self.src += src
-    def enter_func(self):
+    def new_id(self):
+        self.last_id += 1
+        return self.last_id
+    def enter_scope(self, prop):
         ns = dict(self.scope[-1])
         for k in ns: 
-            ns[k] = 'r' # Make variables outside the scope readable
+            ns[k] = 'xr' if 'x' in ns[k] else 'r' # Make variables outside the scope readable
         self.scope.append(ns)
+        self.owners.append(dict(self.owners[-1]))
         self.new_vars.append({})
-        self.scope_prop.append('c') # The scope type is closure.
+        self.scope_prop.append(prop)
+    def leave_scope(self):
+        self.scope.pop()
+        self.owners.pop()
+        self.new_vars.pop()
+        self.scope_prop.pop()
+    def enter_func(self):
+        self.enter_scope('c') # The scope type is closure.
+        self.contexts.append({'captures': []})
+        self.ret_targets.append(None)
+    def leave_func(self):
+        self.leave_scope()
+        self.ret_targets.pop()
+        return self.contexts.pop()['captures']
+    def enter_block(self, n):
+        self.enter_scope('c') # Compiled inline, but scoped like a closure.
+        self.ret_targets.append(n)
+    def leave_block(self):
+        self.leave_scope()
+        self.ret_targets.pop()
     def enter_loop(self):
         ns = dict(self.scope[-1]) # Copy as is.
         self.scope.append(ns)
+        self.owners.append(dict(self.owners[-1]))
         self.new_vars.append({})
         self.scope_prop.append('bl') # The scope type is a basic block + loop. (no closure)
-    def leave_func(self):
-        self.scope.pop()
-        self.new_vars.pop()
-        self.scope_prop.pop()
     def leave_loop(self):
-        self.leave_func()
+        self.leave_scope()
+    def own(self, var_name):
+        self.owners[-1][var_name] = len(self.contexts) - 1
+    def capture(self, var_name, cname):
+        # Functions between the owner of the variable and the current one
+        # carry it in their environment.
+        if var_name in self.runtime_globals:
+            return
+        for ctx in self.contexts[self.owners[-1][var_name] + 1:]:
+            if cname not in ctx['captures']:
+                ctx['captures'].append(cname)
+    def hoisted(self, fn, *args):
+        """Runs fn and returns what it hoisted into self.pre, with its result."""
+        saved = self.pre
+        self.pre = []
+        try:
+            r = fn(*args)
+            return "".join(self.pre), r
+        finally:
+            self.pre = saved
+    def location(self):
+        """(path, line) of the statement being compiled."""
+        path, first = "<source>", 1
+        for x in self.sources or []:
+            if x[0] <= self.line:
+                first, path = x
+        return path, self.line - first + 1
+    def symbol(self, name):
+        """A C++ name for a function, the same from build to build as long
+        as the Pa names do not change."""
+        base = self.generator.func_name(name.replace(".", "_"))
+        symbol, i = base, 1
+        while symbol in self.symbols:
+            i += 1
+            symbol = "%s_%d" % (base, i)
+        self.symbols.add(symbol)
+        return symbol
+    def take_pre(self):
+        pre = "".join(self.pre)
+        self.pre = []
+        return pre
     def define(self, var_name, read_only=False, need_to_be_declared=True):
         self.scope[-1][var_name] = 'w' if not read_only else 'r' # Defined in the scope. writeable.
+        self.own(var_name)
         if need_to_be_declared:
             self.new_vars[-1][var_name] = True
     def import_(self, lib_name, my_name, is_static=False):
         self.scope[-1][my_name] = 'xr' # External, read-only.
+        self.own(my_name)
         self.imports.append([lib_name, my_name, is_static])
     def export_(self, var_name, my_name=None):
         self.scope[-1][var_name] = 'xw' # External, writeable. 
+        self.own(var_name)
         if my_name:
             self.exports.append([var_name, my_name])
         else:
@@ -172,6 +314,7 @@ class Compiler:
         _global = {}
         for k in self.intrinsics: _global[k] = 'xr'
         self.scope = [_global, dict(_global)]
+        self.owners = [dict.fromkeys(_global, 0), dict.fromkeys(_global, 0)]
         self.new_vars = [{}]
         self.scope_prop = ['c']
         src = self._program(self.root)
@@ -185,14 +328,42 @@ class Compiler:
                 self.generator.literal_str(x[0]),
                 self.generator.var_name(x[1])), self.exports)
         )
+        src = self._resolve_import_bindings(src)
+        self.line = 1
         return self.generator.finalize(
                 (
                     src_def_export + 
                     src + 
-                    self.generator.stat_ret(src_export)
+                    self.generator.stat_ret_module(src_export)
                 ),
-                has_entrypoint=(not self.is_library)
+                has_entrypoint=(not self.is_library),
+                functions="".join(self.define_constants() + self.functions),
+                prologue=self.generator.profile_scope(self.location()[0], *self.location()) + self.set_constants()
         )
+    def constant(self, src):
+        """The pooled constant for the literal that src creates. Literals are
+        immutable, so one value serves every evaluation."""
+        if self.constants is None:
+            return src
+        if src not in self.constants:
+            self.constants.append(src)
+        return self.generator.constant_var(self.constants.index(src) + 1)
+    def define_constants(self):
+        return [self.generator.define_constant(i + 1) for i in range(len(self.constants or []))]
+    def set_constants(self):
+        return "".join([self.generator.set_constant(i + 1, x) for i, x in enumerate(self.constants or [])])
+    def _resolve_import_bindings(self, src):
+        # Module members are looked up once, right after the import, unless
+        # the program assigns to them.
+        for site, (module, members) in enumerate(self.bindings):
+            src_bind = ""
+            for k in members:
+                src_bind += self.generator.define_bound_member(
+                        self.generator.bound_member_name(module, site, k),
+                        self.generator.var_name(module), k,
+                        bind=((module, k) not in self.assigned_members))
+            src = src.replace(self.generator.import_bindings_marker(site), src_bind)
+        return src
     # Rules
     def _program(self, ast):
         if ast[0] == 'program':
@@ -207,6 +378,7 @@ class Compiler:
             stat_name = ast[1][0]
             stat_fn = {
                 'stat_assign': self._stat_assign,
+                'stat_augmented_assign': self._stat_augmented_assign,
                 'stat_expr': self._stat_expr,
                 'stat_for': self._stat_for,
                 'stat_while': self._stat_while,
@@ -218,11 +390,19 @@ class Compiler:
                 'stat_import': self._stat_import,
                 'stat_export': self._stat_export,
                 'stat_raise': self._stat_raise,
+                'stat_yield': self._stat_yield,
                 'stat_try': self._stat_try
             }[stat_name]
             #if stat_name in ['stat_export', 'stat_import'] and topmost == False:
             #    raise Exception("import/exports can be used only in the global scope.")
-            return self.generator.finalize_line(stat_fn(ast[1]))
+            self.topmost = topmost
+            line = ""
+            if len(ast) > 2:
+                self.line = ast[2]
+                if self.sources:
+                    line = self.generator.line_directive(*reversed(self.location()))
+            pre, src = self.hoisted(stat_fn, ast[1])
+            return line + pre + self.generator.finalize_line(src)
         else:
             raise Exception("Semantic error")
     def _stat_import(self, ast):
@@ -241,6 +421,12 @@ class Compiler:
                     src += self.generator.define_var(name) 
                 src += self.generator.stat_assign(self.generator.var_name(name), self.generator.stat_import(lib_name))
                 self.import_(lib_name, name)
+                if self.topmost and len(self.scope) == 2:
+                    self.import_sites[name] = len(self.bindings)
+                    src += self.generator.import_bindings_marker(len(self.bindings))
+                    self.bindings.append((name, []))
+                else:
+                    self.import_sites.pop(name, None)
             return src
         else:
             raise Exception("Semantic error")
@@ -264,65 +450,91 @@ class Compiler:
             return self.generator.stat_raise(self._expr(ast[1]))
         else:
             raise Exception("Semantic error")
+    def _stat_yield(self, ast):
+        if ast[0] == 'stat_yield':
+            if len(self.contexts) == 1:
+                raise Exception("Cannot use yield outside a function")
+            return self.generator.stat_yield(self._expr(ast[1]))
+        else:
+            raise Exception("Semantic error")
     def _stat_try(self, ast):
         if ast[0] == 'stat_try':
+            ctx = self.contexts[-1]
+            ctx['try'] = ctx.get('try', 0) + 1 # Returns from here are no tail calls.
             _try = ""
             _catches = []
             _finally = ""
+            _pre = ""
             for i, x in enumerate(ast[1]):
                 if i == 0:
                     _try = "".join(map(lambda y: self._stat(y), x))
                 elif len(x) == 3:
-                    self.define(x[1][1], read_only=True)
+                    self.define(x[1][1], read_only=True, need_to_be_declared=False) # declared by the catch
+                    pre, cls = self.hoisted(self._expr_rvalue, x[0][1])
+                    _pre += pre
                     _catches.append([
-                        self._expr_rvalue(x[0][1]),
+                        cls,
                         self.generator.var_name(x[1][1]),
                         ("".join(map(lambda y: self._stat(y), x[2])))
                     ])
                 else:
                     _finally = "".join(map(lambda y: self._stat(y), x[0]))
-            return self.generator.stat_try(_try, _catches, _finally)
+            ctx['try'] -= 1
+            return self.generator.stat_try(_try, _catches, _finally, _pre)
         else:
             raise Exception("Semantic error")
     def _stat_assign(self, ast):
         if ast[0] == 'stat_assign':
             t = ast[1][0]
             if t[0] == 'def_var':
-                self.enter_func()
-                src = self.generator.evaluate_multiline(*[self._stat(x) for x in ast[1][1]])
-                self.leave_func()
-                
+                src = self._block(ast[1][1])
                 src = self._expr_lvalue_assignment(t[1][1], src)
                 def_vars = ""
                 for x in self.get_reset_new_vars():
                     def_vars += self.generator.define_var(x) 
-                src = def_vars + src
-                return src
+                return def_vars + self.take_pre() + src
             elif t[0] == 'def_func':
-                src = ""
-                args = t[1][1]
-                self._expr_lvalue_predefine(t[1][0][1])
-                self.enter_func()
-                for i, x in enumerate(args):
-                    var_name = x[1][0][1]
-                    if len(x[1]) == 1:
-                        df = self.generator.literal_nil()
-                    else:
-                        df = self._expr(x[1][1])
-                    src += self.generator.define_param(var_name, i, var_name, df)
-                    self.define(var_name, need_to_be_declared=False)
-                for s in ast[1][1]:
-                    src += self._stat(s)
-                self.leave_func()
-                src = self._expr_lvalue_assignment(t[1][0][1], self.generator.literal_func(src))
+                lvalue = t[1][0][1]
+                self._expr_lvalue_predefine(lvalue)
+                name = ".".join([x[1] if x[0] == 'IDENT' else x[1][1] for x in lvalue if x[0] != 'expr_lvalue_item'])
+                n, captures, src = self._func(t[1][1], ast[1][1], name, self_name=lvalue[0][1] if len(lvalue) == 1 else None)
+                src = self._expr_lvalue_assignment(lvalue, src)
+                if len(lvalue) == 1 and self.generator.var_name(lvalue[0][1]) in captures:
+                    src += self.generator.set_env(n, self.generator.var_name(lvalue[0][1])) # Recursion
                 def_vars = ""
                 for x in self.get_reset_new_vars():
                     def_vars += self.generator.define_var(x) 
-                return def_vars + src
+                return def_vars + self.take_pre() + src
             else:
                 raise Exception("Semantic error")
         else:
             raise Exception("Semantic error")
+    def _stat_augmented_assign(self, ast):
+        if ast[0] == 'stat_augmented_assign':
+            op, lvalue, value = ast[1]
+            items = lvalue[1]
+            if len(items) == 1:
+                current = self._expr_rvalue(items)
+                return self._expr_lvalue_assignment(items, self.generator.op(op, current, self._expr(value)))
+            # The container and the key are evaluated once, like in `x[k] = x[k] + v`
+            # without the second lookup of x and k.
+            if len(items) == 2 and items[1][0] == 'expr_lvalue_attr':
+                self.assigned_members.add((items[0][1], items[1][1][1]))
+            rvalue = [[{'expr_lvalue_item': 'expr_rvalue_item', 'expr_lvalue_attr': 'expr_rvalue_attr'}.get(x[0], x[0]), x[1]] for x in items[:-1]]
+            n = self.new_id()
+            self.pre.append(self.generator.define_temp(n, self._expr_rvalue(rvalue)))
+            container = self.generator.temp_var(n)
+            if items[-1][0] == 'expr_lvalue_item':
+                n = self.new_id()
+                self.pre.append(self.generator.define_temp(n, self._expr(items[-1][1])))
+                key = self.generator.temp_var(n)
+                current = self.generator.op("getitem", container, key)
+                return self.generator.op("setitem", container, key, self.generator.op(op, current, self._expr(value)))
+            key = self.generator.literal_cstr(items[-1][1][1])
+            current = self.generator.op("getattr", container, key)
+            return self.generator.op("setattr", container, key, self.generator.op(op, current, self._expr(value)))
+        else:
+            raise Exception("Semantic error")
     def _stat_expr(self, ast):
         if ast[0] == 'stat_expr':
             if ast[1][0] == 'expr':
@@ -338,18 +550,7 @@ class Compiler:
             val = ast[1][1]
             stats = ast[1][2]
             self.define(ident[1], read_only=True, need_to_be_declared=False) # make known. index var
-            src = self.generator.stat_block(
-                self.generator.define_var("_for_ref_", self._expr(val)) +
-                self.generator.define_var("_for_ref_len_", self.generator.op("length", self.generator.var_name("_for_ref_"))) +
-                self.generator.define_var(ident[1]) + 
-                self.generator.stat_for(
-                    self.generator.define_cvar("i64", "__for_index__", "0"),
-                    self.generator.cop("<", "__for_index__", self.generator.raw_var("i64", self.generator.var_name("_for_ref_len_"))),
-                    self.generator.cop("++", "__for_index__"),
-                    self.generator.stat_assign(self.generator.var_name(ident[1]), self.generator.op("getitem", self.generator.var_name("_for_ref_"), self.generator.literal_int("__for_index__"))),
-                    *map(self._stat, stats)
-                )
-            )
+            src = self.generator.stat_for(ident[1], self._expr(val), *map(self._stat, stats))
             self.leave_loop()
             return src
         else:
@@ -359,7 +560,8 @@ class Compiler:
             self.enter_loop() 
             val = ast[1][0]
             stats = ast[1][1]
-            src = self.generator.stat_while(self._expr(val), *map(self._stat, stats)) 
+            pre, cond = self.hoisted(self._expr, val)
+            src = self.generator.stat_while(cond, *map(self._stat, stats), pre=pre)
             self.leave_loop()
             return src
         else:
@@ -380,61 +582,130 @@ class Compiler:
             l = []
             meat = ast[1]
             for i, x in enumerate(meat):
-                if i == 0:
-                    l.append([self._expr(x[0]), "".join(map(self._stat, x[1]))])
-                elif len(x) == 2:
-                    l.append([self._expr(x[0]), "".join(map(self._stat, x[1]))])
+                if len(x) == 2:
+                    pre, cond = self.hoisted(self._expr, x[0]) # Only evaluated when reached
+                    l.append([pre, cond, "".join(map(self._stat, x[1]))])
                 else:
                     l.append(["".join(map(self._stat, x[0]))])
             for x in range(len(l)-1,-1,-1):
                 if len(l[x]) == 1:
                     src = l[x][0]
                 else:
-                    src = self.generator.stat_if(l[x][0], l[x][1], else_stats=src)
+                    src = l[x][0] + self.generator.stat_if(l[x][1], l[x][2], else_stats=src)
             return src
         else:
             raise Exception("Semantic error")
     def _stat_ret(self, ast):
         if ast[0] == 'stat_ret':
-            return self.generator.stat_ret(self._expr(ast[1]));
+            if self.ret_targets[-1] is None:
+                if self._is_tail_call(ast[1]):
+                    return self._tail_call(ast[1][1][0][1])
+                return self.generator.stat_ret(self._expr(ast[1]))
+            return self.generator.stat_ret_block(self.ret_targets[-1], self._expr(ast[1]))
+    def _is_tail_call(self, ast):
+        """Whether `= ast` returns the result of a call from a function, with
+        nothing left to do in the caller."""
+        if len(self.contexts) == 1 or self.contexts[-1].get('try') or self.contexts[-1].get('generator'):
+            return False
+        return len(ast[1]) == 1 and ast[1][0][0] == 'expr_rvalue' and ast[1][0][1][-1][0] == 'expr_rvalue_call'
+    def _tail_call(self, ast):
+        ctx = self.contexts[-1]
+        fargs = ast[-1][1]
+        # A function calling itself by its own name jumps back to its start
+        # with new arguments. The name is bound to the function itself in
+        # its environment, unless a local shadows it.
+        if (len(ast) == 2 and ast[0] == ['IDENT', ctx['self']] and self.owners[-1].get(ctx['self']) < len(self.contexts) - 1 and
+                len(fargs) == len(ctx['params']) and all([x[0] == 'expr' for x in fargs])):
+            ctx['looped'] = True
+            values = [(self.new_id(), self._expr(x)) for x in fargs]
+            return self.generator.stat_tail_loop(ctx['label'], ctx['params'], values)
+        return self.generator.stat_ret(self._expr_rvalue(ast, tail=True))
+    def _func(self, args, stats, name="lambda", symbol_name=None, self_name=None):
+        """Compiles a function into a static C++ function. Returns its id, the
+        variables it captures and the expression creating it."""
+        n = self.new_id()
+        if self.names:
+            symbol_name = self.names[-1][1] + "." + (symbol_name or name)
+            name = self.names[-1][0] + "." + name
+        symbol = self.symbol(symbol_name or name)
+        src = self.generator.profile_scope(name, *self.location())
+        self.names.append((name, symbol_name or name))
+        self.enter_func()
+        ctx = self.contexts[-1]
+        ctx.update({'self': self_name, 'params': [], 'label': symbol + "_tail", 'looped': False, 'generator': self._yields(stats)})
+        for i, x in enumerate(args):
+            var_name = x[1][0][1]
+            if len(x[1]) == 1:
+                pre, df = "", self.generator.literal_nil()
+            else:
+                pre, df = self.hoisted(self._expr, x[1][1])
+            src += pre + self.generator.define_param(var_name, i, var_name, df)
+            self.define(var_name, need_to_be_declared=False)
+            ctx['params'].append(var_name)
+        body = "".join(map(self._stat, stats))
+        if ctx['looped']:
+            src += self.generator.label(ctx['label'])
+        src += body
+        captures = self.leave_func()
+        self.names.pop()
+        self.functions.append(self.generator.define_func(n, symbol, src, captures))
+        if not captures:
+            src = self.generator.literal_func(symbol)
+        else:
+            self.pre.append(self.generator.define_env(n, captures))
+            src = self.generator.literal_func(symbol, self.generator.env_var(n))
+        if ctx['generator']:
+            src = self.generator.literal_generator(src)
+        return n, captures, src
+    def _yields(self, node):
+        """Whether node has a yield of its own, outside the functions and
+        classes defined in it."""
+        if type(node) != list or not node:
+            return False
+        if node[0] == 'stat_yield':
+            return True
+        if node[0] in ('FUNC', 'stat_def_class') or (node[0] == 'stat_assign' and node[1][0][0] == 'def_func'):
+            return False
+        return any([self._yields(x) for x in node])
+    def _block(self, stats):
+        """Compiles a block that evaluates to a value in place and returns the
+        expression holding the value."""
+        if len(stats) == 1 and stats[0][1][0] == 'stat_ret':
+            self.enter_block(None)
+            src = self._expr(stats[0][1][1])
+            self.leave_block()
+            return src
+        n = self.new_id()
+        self.enter_block(n)
+        src = "".join(map(self._stat, stats))
+        self.leave_block()
+        self.pre.append(self.generator.evaluate_block(n, src))
+        return self.generator.temp_var(n)
     # Expressions
     def _expr_literal(self, ast):
         if ast[0] == 'expr_rvalue':
             return self._expr_rvalue(ast[1])
         elif ast[0] == 'BOOL':
             v = {'true': True, 'false': False, 'yes': True, 'no': False}[ast[1]]
-            return self.generator.literal_bool(v) 
+            return self.constant(self.generator.literal_bool(v))
         elif ast[0] == 'NIL':
-            return self.generator.literal_nil() 
+            return self.constant(self.generator.literal_nil())
         elif ast[0] == 'INTEGER':
-            return self.generator.literal_int(str(ast[1]))
+            return self.constant(self.generator.literal_int(str(ast[1])))
         elif ast[0] == 'REAL':
-            return self.generator.literal_real(str(ast[1]))
+            return self.constant(self.generator.literal_real(repr(ast[1])))
         elif ast[0] == 'STRING':
-            return self.generator.literal_str(ast[1])
+            return self.constant(self.generator.literal_str(ast[1]))
+        elif ast[0] == 'expr_length':
+            return self.generator.op("length", self._expr(ast[1]))
+        elif ast[0] == 'expr_length_fixed':
+            return self.generator.cfunc_call("pa_length_if_fixed", self._expr(ast[1]))
+        elif ast[0] == 'expr_length_cached':
+            return self.generator.cfunc_call("pa_length_cached", self._expr_rvalue([['IDENT', ast[1]]]), self._expr(ast[2]))
         elif ast[0] == 'VAR':
-            src = ""
-            self.enter_func()
-            for s in ast[1]:
-                src += self._stat(s)
-            self.leave_func()
-            return self.generator.evaluate_multiline(src)
+            return self._block(ast[1])
         elif ast[0] == 'FUNC':
-            src = ""
-            args = ast[1][0]
-            self.enter_func()
-            for i, x in enumerate(args):
-                var_name = x[1][0][1]
-                if len(x[1]) == 1:
-                    df = self.generator.literal_nil() 
-                else:
-                    df = self._expr(x[1][1])
-                src += self.generator.define_param(var_name, i, var_name, df)
-                self.define(var_name, need_to_be_declared=False)
-            for s in ast[1][1]:
-                src += self._stat(s)
-            self.leave_func()
-            return self.generator.literal_func(src)
+            return self._func(ast[1][0], ast[1][1])[2]
         elif ast[0] == 'LIST':
             return self.generator.literal_list(*map(self._expr, ast[1]))
         elif ast[0] == 'DICT':
@@ -457,6 +728,12 @@ class Compiler:
         elif len(ast) == 2:
             if ast[0] == 'not':
                 return self.generator.op("not", self._expr_literal(ast[1]))
+            elif ast[0] == 'spawn':
+                # The task evaluates the operand in a closure of its own.
+                task = self._func([], [['stat', ['stat_ret', ['expr', [ast[1]]]], self.line]], "spawn")[2]
+                return self.generator.op("spawn", task)
+            elif ast[0] == 'await':
+                return self.generator.op("await", self._expr_literal(ast[1]))
             elif type(ast[1]) == str and ast[1] in '&!?':
                 raise Exception("Not implemented")
             else:
@@ -491,6 +768,8 @@ class Compiler:
     def _expr_lvalue_assignment(self, ast, rvalue):
         src = ""
         i = 0
+        if len(ast) == 2 and ast[0][0] == 'IDENT' and ast[1][0] == 'expr_lvalue_attr':
+            self.assigned_members.add((ast[0][1], ast[1][1][1]))
         while True:
             if len(ast) <= i+1:
                 break # One element left!
@@ -510,10 +789,11 @@ class Compiler:
         elif ast[i][0] == 'expr_lvalue_attr':
             src = self.generator.op("setattr", src, self.generator.literal_cstr(ast[i][1][1]), rvalue)
         return src
-    def _expr_rvalue(self, ast):
+    def _expr_rvalue(self, ast, tail=False):
         if len(ast) == 1:
             var_name = ast[0][1] # IDENT
             if var_name in self.scope[-1]:
+                self.capture(var_name, self.generator.var_name(var_name))
                 return self.generator.var_name(var_name)
             else:
                 raise Exception("No such variable in the scope: " + var_name)
@@ -530,11 +810,15 @@ class Compiler:
                     src = self.generator.op("getitem", src, self._expr(ast[i][1]))
                 elif ast[i][0] == 'expr_rvalue_attr':
                     _this.append(src)
-                    src = self.generator.op("getattr", src, self.generator.literal_cstr(ast[i][1][1]))
+                    if i == 1 and self._is_bound_module(ast[0][1]):
+                        src = self._bound_member(ast[0][1], ast[i][1][1])
+                    else:
+                        src = self.generator.op("getattr", src, self.generator.literal_cstr(ast[i][1][1]))
                 elif ast[i][0] == 'expr_rvalue_call':
                     _this.append(src)
                     fargs = ast[i][1]
-                    src = self.generator.func_call(src, _this[-2], 
+                    call = self.generator.tail_call if tail and i == len(ast) - 1 else self.generator.func_call
+                    src = call(src, _this[-2], 
                             *[self._expr(x) for x in filter(lambda x: x[0] == 'expr', fargs)], 
                             **{x[1][0][1]: self._expr(x[1][1]) for x in filter(lambda x: x[0] == 'expr_func_kwarg', fargs)}
                     )
@@ -544,6 +828,17 @@ class Compiler:
                 if len(ast) <= i:
                     break
             return src
+    def _is_bound_module(self, name):
+        return name in self.import_sites and self.scope[-1].get(name) == 'xr'
+    def _bound_member(self, module, k):
+        site = self.import_sites[module]
+        members = self.bindings[site][1]
+        if k not in members:
+            members.append(k)
+        self.capture(module, self.generator.bound_member_name(module, site, k))
+        return self.generator.bound_member(
+                self.generator.bound_member_name(module, site, k),
+                self.generator.var_name(module), k)
     def _stat_def_class(self, ast):
         if ast[0] == 'stat_def_class':
             self._expr_lvalue_predefine([ast[1][0]])
@@ -552,90 +847,35 @@ class Compiler:
             _destructor = None
             _members = {}
             _operators = {}
+            cls = ast[1][0][1]
             for x in ast[1][1]:
+                # Each value is (hoisted statements, expression); they run
+                # once the class exists, so methods can refer to it.
                 if x[0] == 'stat_class_constructor': 
-                    src = ""
-                    args = x[1][0]
-                    self.enter_func()
-                    for i, y in enumerate(args):
-                        var_name = y[1][0][1]
-                        if len(y[1]) == 1:
-                            df = self.generator.literal_nil() 
-                        else:
-                            df = self._expr(y[1][1])
-                        src += self.generator.define_param(var_name, i, var_name, df)
-                        self.define(var_name, need_to_be_declared=False)
-                    for s in x[1][1]:
-                        src += self._stat(s)
-                    self.leave_func()
-                    _constructor = self.generator.literal_func(src)
+                    _constructor = self.hoisted(lambda: self._func(x[1][0], x[1][1], cls + ".constructor")[2])
                 elif x[0] == 'stat_class_destructor': 
-                    src = ""
-                    args = x[1][0]
-                    self.enter_func()
-                    for i, y in enumerate(args):
-                        var_name = y[1][0][1]
-                        if len(y[1]) == 1:
-                            df = self.generator.literal_nil() 
-                        else:
-                            df = self._expr(y[1][1])
-                        src += self.generator.define_param(var_name, i, var_name, df)
-                        self.define(var_name, need_to_be_declared=False)
-                    for s in x[1][1]:
-                        src += self._stat(s)
-                    self.leave_func()
-                    _destructor = self.generator.literal_func(src)
+                    _destructor = self.hoisted(lambda: self._func(x[1][0], x[1][1], cls + ".destructor")[2])
                 elif x[0] == 'stat_class_method': 
-                    src = ""
-                    args = x[1][1]
-                    self.enter_func()
-                    for i, y in enumerate(args):
-                        var_name = y[1][0][1]
-                        if len(y[1]) == 1:
-                            df = self.generator.literal_nil() 
-                        else:
-                            df = self._expr(y[1][1])
-                        src += self.generator.define_param(var_name, i, var_name, df)
-                        self.define(var_name, need_to_be_declared=False)
-                    for s in x[1][2]:
-                        src += self._stat(s)
-                    self.leave_func()
-                    _members[x[1][0][1]] = self.generator.literal_func(src)
+                    _members[x[1][0][1]] = self.hoisted(lambda: self._func(x[1][1], x[1][2], cls + "." + x[1][0][1])[2])
                 elif x[0] == 'stat_class_property': 
-                    self.enter_func()
-                    n = x[1][0][1]
-                    _members[n] = self.generator.evaluate_multiline(*[self._stat(x) for x in x[1][1]])
-                    self.leave_func()
+                    _members[x[1][0][1]] = self.hoisted(self._block, x[1][1])
                 elif x[0] == 'stat_class_operator':
-                    src = ""
-                    args = x[1][1]
-                    self.enter_func()
-                    for i, y in enumerate(args):
-                        var_name = y[1][0][1]
-                        if len(y[1]) == 1:
-                            df = self.generator.literal_nil() 
-                        else:
-                            df = self._expr(y[1][1])
-                        src += self.generator.define_param(var_name, i, var_name, df)
-                        self.define(var_name, need_to_be_declared=False)
-                    for s in x[1][2]:
-                        src += self._stat(s)
-                    self.leave_func()
-                    _operators[x[1][0][0]] = self.generator.literal_func(src)
+                    op = x[1][0][0]
+                    _operators[op] = self.hoisted(lambda: self._func(x[1][1], x[1][2], cls + ".operator" + op, cls + ".operator_" + OPERATOR_NAMES.get(op, op))[2])
             cls_src = ""
             for x in self.get_reset_new_vars():
                 cls_src += self.generator.define_var(x)
             cls_src += self._expr_lvalue_assignment([ast[1][0]], self.generator.literal_cls())
             if _constructor is not None:
-                cls_src += self.generator.define_operator_in_class(self.generator.var_name(ast[1][0][1]), "constructor", _constructor)
+                cls_src += _constructor[0] + self.generator.define_operator_in_class(self.generator.var_name(ast[1][0][1]), "constructor", _constructor[1])
             if _destructor is not None:
-                cls_src += self.generator.define_operator_in_class(self.generator.var_name(ast[1][0][1]), "destructor", _destructor)
+                cls_src += _destructor[0] + self.generator.define_operator_in_class(self.generator.var_name(ast[1][0][1]), "destructor", _destructor[1])
             for k in _operators:
-                v = _operators[k]
-                cls_src += self.generator.define_operator_in_class(self.generator.var_name(ast[1][0][1]), k, v)
+                pre, v = _operators[k]
+                cls_src += pre + self.generator.define_operator_in_class(self.generator.var_name(ast[1][0][1]), k, v)
             for k in _members:
-                v = _members[k]
-                cls_src += self.generator.define_member_in_class(self.generator.var_name(ast[1][0][1]), k, v)
+                pre, v = _members[k]
+                cls_src += pre + self.generator.define_member_in_class(self.generator.var_name(ast[1][0][1]), k, v)
             return cls_src
         else:
             raise Exception("Semantic error")
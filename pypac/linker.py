@@ -0,0 +1,70 @@
+import os, re
+
+# Same lookup order as pa_import() in palang.h, but for module sources.
+SOURCE_EXTENSIONS = [".pa", ".cc", ".cpp", ".cxx"]
+
+INCLUDE = re.compile(r'^\s*#\s*include\b')
+
+def search_paths(pa_home):
+    return [".", "./libs", os.path.join(pa_home, "libs")]
+
+def find_module(name, pa_home):
+    rel = name.replace('.', '/')
+    for d in search_paths(pa_home):
+        for ext in SOURCE_EXTENSIONS:
+            path = os.path.join(d, rel + ext)
+            if os.path.isfile(path):
+                return path
+    return None
+
+def mangle(name):
+    return name.replace('.', '__')
+
+def resolve(imports, compile_modules, pa_home):
+    """Finds the sources of every module reachable from `imports`.
+    compile_modules(paths) returns (cxx, imports) for each library source;
+    it gets all the modules found at one depth of the import graph at once,
+    so it can compile them in parallel."""
+    modules = []
+    seen = set()
+    pending = list(imports)
+    while pending:
+        level = []
+        for name in pending:
+            if name in seen:
+                continue
+            seen.add(name)
+            path = find_module(name, pa_home)
+            if path is None:
+                raise Exception("Cannot find a source for the module: " + name)
+            level.append((name, path))
+        pending = []
+        for (name, path), (cxx, deps) in zip(level, compile_modules([x[1] for x in level])):
+            modules.append((name, path, cxx))
+            pending += deps
+    return modules
+
+def split_includes(cxx):
+    includes, body = [], []
+    for line in cxx.split("\n"):
+        (includes if INCLUDE.match(line) else body).append(line)
+    return includes, "\n".join(body)
+
+def link(main_cxx, modules):
+    """Puts the program and its modules into a single translation unit, so
+    the compiler can inline across module boundaries. Every module keeps
+    its own namespace, its PA_INIT is renamed after the module and
+    registered so pa_import() finds it without dlopen."""
+    includes = []
+    src_modules = ""
+    for name, path, cxx in modules:
+        inc, body = split_includes(cxx)
+        includes += [x for x in inc if x not in includes]
+        ns = "pa_module__" + mangle(name)
+        init = "PA_INIT__" + mangle(name)
+        src_modules += "/* Module %s (%s) */\n" % (name, path)
+        src_modules += "#define PA_INIT %s\nnamespace %s {\n%s\n}\n#undef PA_INIT\n" % (init, ns, body)
+        src_modules += "static pa_static_module_t %s_static(\"%s\", %s::%s);\n" % (ns, name, ns, init)
+    inc, body = split_includes(main_cxx)
+    includes += [x for x in inc if x not in includes]
+    return "\n".join(includes) + "\n" + src_modules + body
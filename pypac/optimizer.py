@@ -0,0 +1,564 @@
+import re, math, copy
+
+# Optimization passes over the parse tree, between the parser and the
+# Compiler (`pypac -O N`). The tree is the IR: the passes rewrite it in place
+# and only add the nodes below, which the Compiler turns into runtime calls.
+#
+#   ['expr_length', e]               len(e) without the intrinsic call
+#   ['expr_length_fixed', e]         len(e) if e cannot change length, else nothing
+#   ['expr_length_cached', name, e]  the value of `name` when there is one, else len(e)
+#
+# Level 1 folds constant expressions and removes code that cannot run; the
+# Compiler also keeps literals in a constant pool. Level 2 adds common
+# subexpression elimination and hoists loop-invariant expressions. Values in
+# Pa are boxed and any operator may be overloaded, so both only touch
+# expressions that are provably numeric (see Domain), plus len() of a value
+# that the loop does not assign.
+
+BINARY = set(["*", "/", "mod", "+", "-", "==", "!=", ">", ">=", "<", "<=", "->", "->>", "<-", "and", "or"])
+ARITHMETIC = set(["+", "-", "*", "/", "mod"])
+COMPARISON = set(["==", "!=", ">", ">=", "<", "<="])
+LITERALS = set(["INTEGER", "REAL", "STRING", "BOOL", "NIL"])
+INT_MIN, INT_MAX = -2 ** 63, 2 ** 63 - 1
+# A string literal is copied into C++ as written; folding "\x4" + "1" would
+# change what the escape means.
+OPEN_ESCAPE = re.compile(r'\\(x[0-9a-fA-F]*|[0-7]{1,2})$')
+
+def optimize(ast, level):
+    if level >= 1:
+        Folder().stats(ast[1])
+    if level >= 2:
+        Dataflow(ast).run()
+    return ast
+
+# Tree helpers
+def is_group(node):
+    return type(node) == list and len(node) >= 3 and len(node) % 2 == 1 and node[1] in BINARY
+def is_literal(node):
+    return type(node) == list and len(node) == 2 and node[0] in LITERALS
+def is_ident(node):
+    return type(node) == list and len(node) == 2 and node[0] == 'expr_rvalue' and len(node[1]) == 1
+def ident(name):
+    return ['expr_rvalue', [['IDENT', name]]]
+def assign(name, node, line):
+    return ['stat', ['stat_assign', [['def_var', ['expr_lvalue', [['IDENT', name]]]], [['stat', ['stat_ret', ['expr', [node]]], line]]]], line]
+def is_expr_block(stats):
+    """Whether an assignment's block is just `= expression`."""
+    return len(stats) == 1 and stats[0][1][0] == 'stat_ret'
+def index_of(stats, stat):
+    """Position of stat itself; list.index would compare equal copies."""
+    for i, x in enumerate(stats):
+        if x is stat:
+            return i
+    raise ValueError("statement not found")
+def truth(node):
+    """True or False for a BOOL literal, None for anything else."""
+    if type(node) == list and len(node) == 2 and node[0] == 'BOOL':
+        return node[1] in ('true', 'yes')
+    return None
+
+def fold_binary(op, a, b):
+    """The literal a op b evaluates to, the way palang.h computes it, or None
+    when it is not known at compile time."""
+    ta, tb = a[0], b[0]
+    if ta in ('INTEGER', 'REAL') and tb in ('INTEGER', 'REAL'):
+        x, y = a[1], b[1]
+        if op in COMPARISON:
+            if op == '!=' and ta == tb == 'INTEGER':
+                return None # The runtime answers with an integer there.
+            r = {'==': x == y, '!=': x != y, '>': x > y, '>=': x >= y, '<': x < y, '<=': x <= y}[op]
+            return ['BOOL', 'true' if r else 'false']
+        if op not in ARITHMETIC:
+            return None
+        if ta == tb == 'INTEGER':
+            if op in ('/', 'mod'):
+                if y == 0:
+                    return None # Raises at runtime.
+                q = abs(x) // abs(y) * (1 if (x < 0) == (y < 0) else -1) # C truncates.
+                r = q if op == '/' else x - q * y
+            else:
+                r = {'+': x + y, '-': x - y, '*': x * y}[op]
+            return ['INTEGER', r] if INT_MIN <= r <= INT_MAX else None
+        x, y = float(x), float(y)
+        try:
+            r = {'+': lambda: x + y, '-': lambda: x - y, '*': lambda: x * y,
+                 '/': lambda: x / y, 'mod': lambda: math.fmod(x, y)}[op]()
+        except (ZeroDivisionError, ValueError, OverflowError):
+            return None
+        return ['REAL', r] if not (math.isinf(r) or math.isnan(r)) else None
+    if ta == tb == 'STRING' and op == '+' and not OPEN_ESCAPE.search(a[1]):
+        return ['STRING', a[1] + b[1]]
+    if ta == tb == 'BOOL' and op in ('and', 'or'):
+        r = (truth(a) and truth(b)) if op == 'and' else (truth(a) or truth(b))
+        return ['BOOL', 'true' if r else 'false']
+    return None
+
+class Folder:
+    """Constant folding, then removal of code that cannot run: statements
+    after break, continue, return or raise, branches whose condition folded
+    to a constant, and literals evaluated for nothing."""
+    def stats(self, stats):
+        out = []
+        for stat in stats:
+            for x in self.stat(stat):
+                out.append(x)
+                if x[1][0] in ('stat_break', 'stat_continue', 'stat_ret', 'stat_raise'):
+                    stats[:] = out
+                    return stats
+        stats[:] = out
+        return stats
+    def stat(self, stat):
+        """The statements stat becomes, none when it goes away."""
+        s = stat[1]
+        kind = s[0]
+        if kind == 'stat_assign':
+            target, block = s[1]
+            if target[0] == 'def_var':
+                self.lvalue(target[1][1])
+                self.stats(block)
+            else:
+                self.func(target[1][1], block)
+        elif kind == 'stat_augmented_assign':
+            self.lvalue(s[1][1][1])
+            self.expr(s[1][2])
+        elif kind in ('stat_expr', 'stat_ret', 'stat_raise', 'stat_yield'):
+            self.expr(s[1])
+            if kind == 'stat_expr' and is_literal(s[1][1][0]):
+                return []
+        elif kind == 'stat_if':
+            branches = []
+            for b in s[1]:
+                if len(b) == 2:
+                    self.expr(b[0])
+                    t = truth(b[0][1][0])
+                    if t is False:
+                        continue
+                    self.stats(b[1])
+                    if t is True:
+                        branches.append([b[1]]) # The rest cannot be reached.
+                        break
+                    branches.append(b)
+                else:
+                    self.stats(b[0])
+                    branches.append(b)
+            if not branches:
+                return []
+            if len(branches[0]) == 1:
+                return branches[0][0]
+            s[1] = branches
+        elif kind == 'stat_while':
+            self.expr(s[1][0])
+            if truth(s[1][0][1][0]) is False:
+                return []
+            self.stats(s[1][1])
+        elif kind == 'stat_for':
+            self.expr(s[1][1])
+            self.stats(s[1][2])
+        elif kind == 'stat_try':
+            for i, x in enumerate(s[1]):
+                if i == 0:
+                    self.stats(x)
+                elif len(x) == 3:
+                    self.stats(x[2])
+                else:
+                    self.stats(x[0])
+        elif kind == 'stat_def_class':
+            for m in s[1][1]:
+                if m[0] in ('stat_class_method', 'stat_class_operator'):
+                    self.func(m[1][1], m[1][2])
+                elif m[0] in ('stat_class_constructor', 'stat_class_destructor'):
+                    self.func(m[1][0], m[1][1])
+                elif m[0] == 'stat_class_property':
+                    self.stats(m[1][1])
+        return [stat]
+    def func(self, args, stats):
+        for a in args:
+            if len(a[1]) > 1:
+                self.expr(a[1][1])
+        self.stats(stats)
+    def lvalue(self, items):
+        for x in items:
+            if x[0] == 'expr_lvalue_item':
+                self.expr(x[1])
+    def expr(self, e):
+        e[1][0] = self.node(e[1][0])
+        return e
+    def node(self, n):
+        if type(n) != list or not n:
+            return n
+        if is_group(n):
+            n = [self.node(x) if i % 2 == 0 else x for i, x in enumerate(n)]
+            # Operators are left associative; only a constant prefix folds.
+            while len(n) >= 3 and is_literal(n[0]) and is_literal(n[2]):
+                r = fold_binary(n[1], n[0], n[2])
+                if r is None:
+                    break
+                n = [r] + n[3:]
+            return n[0] if len(n) == 1 else n
+        if len(n) == 2 and n[0] in ('not', 'spawn', 'await'):
+            return [n[0], self.node(n[1])]
+        if n[0] == 'expr_rvalue':
+            for x in n[1]:
+                if x[0] == 'expr_rvalue_item':
+                    self.expr(x[1])
+                elif x[0] == 'expr_rvalue_call':
+                    for a in x[1]:
+                        self.expr(a[1][1] if a[0] == 'expr_func_kwarg' else a)
+            return n
+        if n[0] == 'LIST':
+            for x in n[1]:
+                self.expr(x)
+        elif n[0] == 'DICT':
+            for x in n[1]:
+                x[0] = self.node(x[0])
+                self.expr(x[1])
+        elif n[0] == 'FUNC':
+            self.func(n[1][0], n[1][1])
+        elif n[0] == 'VAR':
+            self.stats(n[1])
+        return n
+
+class Domain:
+    """Statements that share local variables: the module body, a function or
+    a block, without the functions and blocks nested in it. Those can read
+    its variables but never assign them, so every assignment to a local is
+    in sight here.
+
+    A local is numeric when each assignment gives it a number: literals,
+    numeric locals and + - * / mod of those, dividing only by a literal
+    that cannot fault. Expressions over numeric locals cannot raise, call
+    user code or observe when they run, so they can be computed once or
+    early."""
+    def __init__(self, flow, params, stats):
+        self.flow = flow
+        self.params = params
+        self.stats = stats
+        self.numeric = set()
+    def run(self):
+        self.infer()
+        self.hoist(self.stats)
+        self.cse(self.stats)
+
+    # Walking the domain
+    def parts(self, stat):
+        """(expressions it evaluates, statement lists inside it, names it
+        binds with their value or None when the value is not a plain
+        expression)."""
+        s = stat[1]
+        kind = s[0]
+        exprs, lists, binds = [], [], []
+        if kind == 'stat_assign':
+            target, block = s[1]
+            lvalue = target[1][1] if target[0] == 'def_var' else target[1][0][1]
+            exprs += [x[1] for x in lvalue if x[0] == 'expr_lvalue_item']
+            name = lvalue[0][1] if len(lvalue) == 1 else None
+            if target[0] == 'def_var' and is_expr_block(block):
+                exprs.append(block[0][1][1])
+                binds.append((name, block[0][1][1][1][0]))
+            else:
+                binds.append((name, None))
+        elif kind == 'stat_augmented_assign':
+            op, lvalue, value = s[1]
+            exprs += [x[1] for x in lvalue[1] if x[0] == 'expr_lvalue_item'] + [value]
+            if len(lvalue[1]) == 1:
+                name = lvalue[1][0][1]
+                binds.append((name, [ident(name), op[0], value[1][0]]))
+        elif kind in ('stat_expr', 'stat_ret', 'stat_raise', 'stat_yield'):
+            exprs.append(s[1])
+        elif kind == 'stat_if':
+            for b in s[1]:
+                if len(b) == 2:
+                    exprs.append(b[0])
+                lists.append(b[-1])
+        elif kind == 'stat_while':
+            exprs.append(s[1][0])
+            lists.append(s[1][1])
+        elif kind == 'stat_for':
+            exprs.append(s[1][1])
+            lists.append(s[1][2])
+            binds.append((s[1][0][1], None))
+        elif kind == 'stat_try':
+            for i, x in enumerate(s[1]):
+                if i == 0:
+                    lists.append(x)
+                elif len(x) == 3:
+                    binds.append((x[1][1], None))
+                    lists.append(x[2])
+                else:
+                    lists.append(x[0])
+        elif kind == 'stat_def_class':
+            binds.append((s[1][0][1], None))
+        elif kind == 'stat_import':
+            for x in s[1]:
+                binds.append(((x[1] if len(x) > 1 else x[0])[1], None))
+        return exprs, lists, [x for x in binds if x[0] is not None]
+    def bindings(self, stats, out):
+        """Appends (name, value) for every assignment in stats, nested
+        statements included."""
+        for stat in stats:
+            exprs, lists, binds = self.parts(stat)
+            out += binds
+            for l in lists:
+                self.bindings(l, out)
+        return out
+    def nodes(self, e, visit):
+        """Calls visit(parent, index) for the nodes of the expression e that
+        are evaluated with it; nested functions and blocks are not."""
+        self.node(e[1], 0, visit)
+    def node(self, parent, i, visit):
+        n = parent[i]
+        if type(n) != list or not n:
+            return
+        if visit(parent, i) is False:
+            return
+        n = parent[i]
+        if is_group(n):
+            for j in range(0, len(n), 2):
+                self.node(n, j, visit)
+        elif n[0] in ('not', 'spawn', 'await') and len(n) == 2:
+            if n[0] != 'spawn': # Runs in a task of its own.
+                self.node(n, 1, visit)
+        elif n[0] == 'expr_rvalue':
+            for x in n[1]:
+                if x[0] == 'expr_rvalue_item':
+                    self.nodes(x[1], visit)
+                elif x[0] == 'expr_rvalue_call':
+                    for a in x[1]:
+                        self.nodes(a[1][1] if a[0] == 'expr_func_kwarg' else a, visit)
+        elif n[0] in ('expr_length', 'expr_length_fixed'):
+            self.nodes(n[1], visit)
+        elif n[0] == 'LIST':
+            for x in n[1]:
+                self.nodes(x, visit)
+        elif n[0] == 'DICT':
+            for x in n[1]:
+                self.node(x, 0, visit)
+                self.nodes(x[1], visit)
+    def idents(self, n, out):
+        def visit(parent, i):
+            if is_ident(parent[i]):
+                out.add(parent[i][1][0][1])
+        self.node([n], 0, visit)
+        return out
+
+    # Numeric locals
+    def infer(self):
+        binds = self.bindings(self.stats, [])
+        values = {}
+        for name, value in binds:
+            values.setdefault(name, []).append(value)
+        self.numeric = set(k for k, v in values.items() if None not in v and k not in self.params)
+        changed = True
+        while changed:
+            changed = False
+            for k in list(self.numeric):
+                if not all(self.is_numeric(v) for v in values[k]):
+                    self.numeric.discard(k)
+                    changed = True
+    def is_numeric(self, n):
+        if type(n) != list:
+            return False
+        if n[0] in ('INTEGER', 'REAL') and len(n) == 2:
+            return True
+        if is_ident(n):
+            return n[1][0][1] in self.numeric
+        if is_group(n):
+            for j in range(1, len(n), 2):
+                if n[j] not in ARITHMETIC:
+                    return False
+                if n[j] in ('/', 'mod'):
+                    d = n[j + 1]
+                    # x / 0 raises and INT64_MIN / -1 faults.
+                    if not (d[0] == 'INTEGER' and d[1] not in (0, -1) or d[0] == 'REAL' and d[1] != 0):
+                        return False
+            return all(self.is_numeric(n[j]) for j in range(0, len(n), 2))
+        return False
+
+    # Loop-invariant hoisting
+    def hoist(self, stats):
+        i = 0
+        while i < len(stats):
+            stat = stats[i]
+            exprs, lists, _ = self.parts(stat)
+            if stat[1][0] in ('stat_while', 'stat_for'):
+                pre = self.hoist_loop(stat, exprs if stat[1][0] == 'stat_while' else [], lists)
+                stats[i:i] = pre
+                i += len(pre)
+            for l in lists:
+                self.hoist(l)
+            i += 1
+    def hoist_loop(self, stat, exprs, lists):
+        assigned = set(name for name, _ in self.bindings([stat], []))
+        invariant = self.numeric - assigned
+        temps = {} # repr of the node -> temporary
+        pre = []
+        def visit(parent, i):
+            n = parent[i]
+            if is_group(n) and self.is_numeric(n) and self.idents(n, set()) <= invariant:
+                key = repr(n)
+                if key not in temps:
+                    temps[key] = self.flow.temp()
+                    pre.append(assign(temps[key], n, stat[2]))
+                parent[i] = ident(temps[key])
+                return False
+            if n[0] == 'expr_length' and is_ident(n[1][1][0]) and n[1][1][0][1][0][1] not in assigned:
+                key = repr(n)
+                if key not in temps:
+                    temps[key] = self.flow.temp()
+                    pre.append(assign(temps[key], ['expr_length_fixed', n[1]], stat[2]))
+                parent[i] = ['expr_length_cached', temps[key], n[1]]
+                return False
+        for e in exprs:
+            self.nodes(e, visit)
+        def walk(stats):
+            for s in stats:
+                es, ls, _ = self.parts(s)
+                for e in es:
+                    self.nodes(e, visit)
+                for l in ls:
+                    walk(l)
+        for l in lists:
+            walk(l)
+        return pre
+
+    # Common subexpressions, within a run of statements without control flow
+    def cse(self, stats):
+        run = []
+        for stat in list(stats):
+            exprs, lists, _ = self.parts(stat)
+            if lists or stat[1][0] not in ('stat_assign', 'stat_augmented_assign', 'stat_expr', 'stat_ret', 'stat_raise'):
+                self.cse_run(stats, run)
+                run = []
+                for l in lists:
+                    self.cse(l)
+            else:
+                run.append(stat)
+        self.cse_run(stats, run)
+    def cse_run(self, stats, run):
+        while True:
+            best = self.repeated(run)
+            if not best:
+                return
+            key, places = best
+            name = self.flow.temp()
+            first = places[0][0]
+            temp = assign(name, copy.deepcopy(places[0][1][places[0][2]]), first[2])
+            stats.insert(index_of(stats, first), temp)
+            run.insert(index_of(run, first), temp)
+            for _, parent, i in places:
+                parent[i] = ident(name)
+    def repeated(self, run):
+        """The largest numeric expression computed twice or more in run with
+        the same operands, and where: [(statement, parent, index)]."""
+        version = {}
+        seen = {}
+        for stat in run:
+            exprs, _, binds = self.parts(stat)
+            def visit(parent, i):
+                n = parent[i]
+                if is_group(n) and self.is_numeric(n):
+                    names = sorted(self.idents(n, set()))
+                    key = (repr(n), tuple(version.get(x, 0) for x in names))
+                    seen.setdefault(key, []).append((stat, parent, i))
+            for e in exprs:
+                self.nodes(e, visit)
+            for name, _ in binds:
+                version[name] = version.get(name, 0) + 1
+        best = None
+        for key, places in seen.items():
+            if len(places) > 1 and (best is None or len(key[0]) > len(best[0][0])):
+                best = (key, places)
+        return best
+
+class Dataflow:
+    """Level 2: len() without the intrinsic call, then hoisting and common
+    subexpressions in every domain of the program."""
+    def __init__(self, ast):
+        self.ast = ast
+        self.names = set()
+        self.collect(ast)
+        self.counter = 0
+        self.pending = []
+    def collect(self, n):
+        if type(n) == list:
+            if len(n) == 2 and n[0] == 'IDENT':
+                self.names.add(n[1])
+            for x in n:
+                self.collect(x)
+    def temp(self):
+        while True:
+            self.counter += 1
+            name = "__opt%d" % (self.counter,)
+            if name not in self.names:
+                return name
+    def run(self):
+        # Nothing may rebind len for the call to be the intrinsic.
+        if 'len' not in self.bound_anywhere():
+            self.inline_len(self.ast)
+        self.domain([], self.ast[1])
+        self.discover(self.ast[1])
+        for d in self.pending:
+            d.run()
+    def discover(self, n):
+        """Finds the functions and blocks nested anywhere in n."""
+        if type(n) != list or not n:
+            return
+        head = n[0]
+        if head == 'stat_assign':
+            target, block = n[1]
+            if target[0] == 'def_func':
+                self.func(target[1][1], block)
+            elif not is_expr_block(block):
+                self.domain([], block)
+        elif head == 'FUNC' and len(n) == 2:
+            self.func(n[1][0], n[1][1])
+        elif head == 'VAR' and len(n) == 2:
+            self.domain([], n[1])
+        elif head in ('stat_class_method', 'stat_class_operator'):
+            self.func(n[1][1], n[1][2])
+        elif head in ('stat_class_constructor', 'stat_class_destructor'):
+            self.func(n[1][0], n[1][1])
+        elif head == 'stat_class_property':
+            self.domain([], n[1][1])
+        for x in n:
+            self.discover(x)
+    def bound_anywhere(self):
+        names = set()
+        def walk(n):
+            if type(n) != list:
+                return
+            if n and n[0] == 'def_func_arg':
+                names.add(n[1][0][1])
+            elif n and n[0] == 'expr_lvalue':
+                names.add(n[1][0][1])
+            elif n and n[0] == 'stat_for':
+                names.add(n[1][0][1])
+            elif n and n[0] in ('stat_def_class', 'stat_import'):
+                names.update(self.idents_of(n))
+            for x in n:
+                walk(x)
+        walk(self.ast)
+        return names
+    def idents_of(self, n):
+        out = set()
+        def walk(x):
+            if type(x) == list:
+                if len(x) == 2 and x[0] == 'IDENT':
+                    out.add(x[1])
+                for y in x:
+                    walk(y)
+        walk(n)
+        return out
+    def inline_len(self, n):
+        if type(n) != list:
+            return
+        for i, x in enumerate(n):
+            if (type(x) == list and len(x) == 2 and x[0] == 'expr_rvalue' and len(x[1]) == 2 and
+                    x[1][0] == ['IDENT', 'len'] and x[1][1][0] == 'expr_rvalue_call' and
+                    len(x[1][1][1]) == 1 and x[1][1][1][0][0] == 'expr'):
+                n[i] = ['expr_length', x[1][1][1][0]]
+            self.inline_len(n[i])
+    def domain(self, params, stats):
+        self.pending.append(Domain(self, params, stats))
+    def func(self, args, stats):
+        self.domain([a[1][0][1] for a in args], stats)
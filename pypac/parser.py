@@ -1,138 +1,547 @@
-from pyparsing import *
-
-ParserElement.enablePackrat()
-
-# Grammatical components
-LPAREN, RPAREN, LBRACK, RBRACK, LBRACE, RBRACE, COLON =\
-map(Suppress,"()[]{}:")
-COMMA, DOT, OP_ASSIGN = map(Suppress, ",.=")
-NEWLINE = Suppress(";")
-
-COMMENT = Literal('#') + restOfLine
-
-# Literals
-#FIXME Ident shouldn't be matched if it's a reserved keyword
-IDENT = Regex(r'[a-zA-Z_][a-zA-Z0-9_]*')\
-        .setParseAction(lambda t: ["IDENT", t[0]])
-PACKAGE_NAME = Combine(Regex(r'[a-zA-Z_][a-zA-Z0-9_]*') + ZeroOrMore(Literal(".") + Regex(r'[a-zA-Z_][a-zA-Z0-9_]*'))).setParseAction(lambda t: ["PACKAGE_NAME", t[0]])
-NIL     = Literal("nil").setParseAction(lambda t: ["NIL", t[0]])
-INTEGER = Combine(Optional(oneOf("+ -")) + Word(nums))\
-    .setName("integer")\
-    .setParseAction(lambda t: ["INTEGER", int(t[0])])
-REAL    = Combine(Optional(oneOf("+ -")) + Word(nums) + "." +
-               Optional(Word(nums)) +
-               Optional(oneOf("e E")+Optional(oneOf("+ -")) +Word(nums)))\
-    .setName("real")\
-    .setParseAction(lambda t: ["REAL", float(t[0])])
-STRING  = QuotedString('"', multiline=False)\
-        .setName("string")\
-        .setParseAction(lambda t: ["STRING", t[0]])
-BOOL    = (Literal("true") | Literal("false") | Literal('yes') | Literal('no')).setParseAction(lambda t: ["BOOL", t[0]])
-LIST    = Forward()
-DICT    = Forward()
-FUNC    = Forward()
-VAR     = Forward()
-
-# General rules
-expr = Forward()
-stat = Forward()
-stat_ret = Forward()
-stat_one_line = Group(stat_ret).setParseAction(lambda t: ['stat', t[0]])
-
-
-# L-value expression
-expr_lvalue_item = Group(LBRACK + expr + RBRACK)\
-        .setParseAction(lambda t: ["expr_lvalue_item", t[0]])
-expr_lvalue_attr = Group(DOT + IDENT)\
-        .setParseAction(lambda t: ["expr_lvalue_attr", t[0]])
-expr_lvalue = Group(Group(IDENT) + ZeroOrMore(Group(expr_lvalue_item|expr_lvalue_attr)))\
-        .setParseAction(lambda t: ["expr_lvalue", t[0]])
-
-expr_rvalue_item = Group(LBRACK + expr + RBRACK)\
-        .setParseAction(lambda t: ["expr_rvalue_item", t[0]])
-expr_rvalue_attr = Group(DOT + IDENT)\
-        .setParseAction(lambda t: ["expr_rvalue_attr", t[0]])
-
-expr_func_kwarg = Group(Group(IDENT) + OP_ASSIGN + Group(expr)).setParseAction(lambda t: ['expr_func_kwarg', t[0]])
-expr_rvalue_call = (LPAREN + Group(Optional(delimitedList(Group(expr_func_kwarg|expr)))) + RPAREN)\
-        .setParseAction(lambda t: ["expr_rvalue_call", t[0]])
-
-expr_rvalue = Group(Group(IDENT) + ZeroOrMore(Group(expr_rvalue_item|expr_rvalue_attr|expr_rvalue_call)))\
-        .setParseAction(lambda t: ["expr_rvalue", t[0]])
-
-def_var = Group(expr_lvalue)\
-        .setParseAction(lambda t: ["def_var", t[0]])
-
-def_stat_block = (Group(stat_one_line))|(LBRACE + ZeroOrMore(Group(stat)) + RBRACE)
-def_func_arg = Group(Group(IDENT) + Optional(OP_ASSIGN + Group(expr))).setParseAction(lambda t: ['def_func_arg', t[0]])
-def_func_args = LPAREN + Optional(delimitedList(Group(def_func_arg))) + RPAREN
-def_func = Group(Group(expr_lvalue) + Group(def_func_args))\
-        .setParseAction(lambda t: ["def_func", t[0]])
-
-expr_literal = Group(BOOL | NIL | REAL | INTEGER | STRING | LIST | DICT | FUNC | VAR | expr_rvalue)
-
-
-LIST << Group(LBRACK + Optional(delimitedList(Group(expr))) + RBRACK)\
-        .setParseAction(lambda t: ["LIST", t[0]])
-
-DICT << Group(LBRACE + Optional(delimitedList(Group(expr_literal + COLON + Group(expr)))) + RBRACE)\
-        .setParseAction(lambda t: ["DICT", t[0]])
-
-FUNC << Group(Suppress("func") + Group(def_func_args) + Group(def_stat_block)).setParseAction(lambda t: ["FUNC", t[0]])
-
-VAR << Group(Suppress("var") + def_stat_block).setParseAction(lambda t: ["VAR", t[0]])
-
-# Expression
-expr << Group(operatorPrecedence(expr_literal, [
-        (oneOf("new"), 1, opAssoc.RIGHT),
-        (oneOf("* / mod"), 2, opAssoc.LEFT),
-        (oneOf("+ -"), 2, opAssoc.LEFT),
-        (oneOf("== != > >= < <="), 2, opAssoc.LEFT),
-        (oneOf("-> <-"), 2, opAssoc.LEFT),
-        (oneOf("not"), 1, opAssoc.RIGHT),
-        (oneOf("and"), 2, opAssoc.LEFT),
-        (oneOf("or"), 2, opAssoc.LEFT),
-        (oneOf("& ? !"), 1, opAssoc.LEFT),
-])).setParseAction(lambda t: ["expr", t[0]])
-
-# Statements
-stat_class_constructor = Group(Suppress("constructor") + Group(def_func_args) + Group(def_stat_block)).setParseAction(lambda t: ["stat_class_constructor", t[0]])
-stat_class_destructor = Group(Suppress("destructor") + Group(def_func_args) + Group(def_stat_block)).setParseAction(lambda t: ["stat_class_destructor", t[0]])
-stat_class_method = Group(Suppress("method") + Group(IDENT) + Group(def_func_args) + Group(def_stat_block)).setParseAction(lambda t: ["stat_class_method", t[0]])
-stat_class_operator = Group(Suppress("operator") + Group(oneOf("* / mod + - == != > >= < <= -> <- not and or & ? ! getattr setattr getitem setitem length")) + Group(def_func_args) + Group(def_stat_block)).setParseAction(lambda t: ["stat_class_operator", t[0]])
-stat_class_property = Group(Suppress("property") + Group(IDENT) + Group(def_stat_block)).setParseAction(lambda t: ["stat_class_property", t[0]])
-stat_def_class = Group(Suppress("class") + Group(IDENT) + LBRACE + Group(ZeroOrMore(Group(stat_class_method|stat_class_operator|stat_class_property|stat_class_constructor|stat_class_destructor))) + RBRACE).setParseAction(lambda t: ["stat_def_class", t[0]])
-
-expr_stat_block = ((COMMA + Group(stat))|(LBRACE + ZeroOrMore(Group(stat)) + RBRACE))
-stat_if = Group(Suppress("if") + Group(Group(expr) + Group(expr_stat_block)) + ZeroOrMore(Group(Suppress("elif") + Group(expr) + Group(expr_stat_block))) + Optional(Group(Suppress("else") + Group(expr_stat_block)))).setParseAction(lambda t: ["stat_if", t[0]])
-stat_for = Group(Suppress("for") + Group(IDENT) + Suppress("in") + Group(expr) + Group(expr_stat_block)).setParseAction(lambda t: ["stat_for", t[0]])
-stat_while = Group(Suppress("while") + Group(expr) + Group(expr_stat_block)).setParseAction(lambda t: ["stat_while", t[0]])
-stat_assign = Group(Group(def_func|def_var) + Group(def_stat_block)).setParseAction(lambda t: ["stat_assign", t[0]])
-stat_ret << Group(OP_ASSIGN + expr).setParseAction(lambda t: ["stat_ret", t[0]])
-stat_expr = Group(expr).setParseAction(lambda t: ["stat_expr", t[0]])
-stat_break = Group(Suppress("break")).setParseAction(lambda t: ["stat_break"])
-stat_continue = Group(Suppress("continue")).setParseAction(lambda t: ["stat_continue"])
-stat_import = Group(Suppress("import") + Group(Group(PACKAGE_NAME) + Optional(Group(Suppress("as") + IDENT)))).setParseAction(lambda t: ["stat_import", t[0]])
-stat_export = Group(Suppress("export") + Group(Group(IDENT) + Optional(Group(Suppress("as") + IDENT)))).setParseAction(lambda t: ["stat_export", t[0]])
-stat_try = Group(Suppress("try") + 
-        Group(expr_stat_block) + 
-        OneOrMore(Group(
-            Suppress("except") +
-            Group(expr_rvalue) +    
-            Group(IDENT) +
-            Group(expr_stat_block)
-        )) +
-        Optional(Group(
-            Suppress("finally") +
-            Group(expr_stat_block)
-        ))
-).setParseAction(lambda t: ["stat_try", t[0]])
-stat_raise = Group(Suppress("raise") + expr).setParseAction(lambda t: ["stat_raise", t[0]])
-stat << Group((stat_def_class | stat_import | stat_export | stat_try | stat_raise | stat_if | stat_for | stat_while | stat_break | stat_continue | stat_assign | stat_ret | stat_expr) + Optional(NEWLINE)).setParseAction(lambda t: ["stat", t[0]])
-
-# Program
-program = ZeroOrMore(Group(stat)).setParseAction(lambda t: ["program", t])
-program.ignore(COMMENT)
- 
+import re, sys, gc, bisect
+from itertools import islice
+
+# Hand-written lexer and recursive-descent parser for Pa.
+#
+# The parser produces the same nested lists the Compiler walks, e.g.
+#   ['stat', ['stat_assign', [['def_var', ['expr_lvalue', [['IDENT', 'x']]]], [...]]], 1]
+# where the last item of a statement is its source line. It follows the same
+# ordered choices as the grammar it replaced, backtracking where an
+# alternative does not match. Keywords only match whole words.
+
+class ParseError(Exception):
+    pass
+
+# Operator precedence table, highest first: (operators, arity, associativity)
+LEFT, RIGHT = 'left', 'right'
+OPERATORS = [
+    (["new", "spawn", "await"], 1, RIGHT),
+    (["*", "/", "mod"], 2, LEFT),
+    (["+", "-"], 2, LEFT),
+    (["==", "!=", ">", ">=", "<", "<="], 2, LEFT),
+    (["->", "->>", "<-"], 2, LEFT),
+    (["not"], 1, RIGHT),
+    (["and"], 2, LEFT),
+    (["or"], 2, LEFT),
+    (["&", "?", "!"], 1, LEFT),
+]
+
+CLASS_OPERATORS = ["*", "/", "mod", "+", "-", "==", "!=", ">", ">=", "<", "<=", "->", "->>", "<-",
+                   "not", "and", "or", "&", "?", "!", "getattr", "setattr", "getitem", "setitem", "length"]
+
+BOOLS = ["true", "false", "yes", "no"]
+
+AUGMENTED_ASSIGNMENTS = ["+=", "-=", "*="]
+
+# Tokens: (kind, value, offset, adjacent) where `adjacent` tells whether the
+# token directly follows the previous one, without whitespace or comments.
+NAME, INT, REAL, STR, OP, EOF = 'name', 'int', 'real', 'str', 'op', 'eof'
+
+TOKEN = re.compile(r'''
+    (?P<space>[ \t\r\n]+|\#[^\n]*)
+  | (?P<real>[0-9]+\.[0-9]*(?:[eE][+-]?[0-9]+)?)
+  | (?P<int>[0-9]+)
+  | (?P<name>[a-zA-Z_][a-zA-Z0-9_]*)
+  | (?P<str>"[^"\n\r]*")
+  | (?P<lt_neg><(?=-[0-9]))
+  | (?P<op>->>|->|<-|==|!=|>=|<=|\+=|-=|\*=|[-+*/<>=&?!()\[\]{}:,.;])
+''', re.VERBOSE)
+
+def tokenize(source):
+    """Yields the tokens of `source` one at a time, ending with EOF."""
+    pos = 0
+    adjacent = False
+    end = len(source)
+    match = TOKEN.match
+    while pos < end:
+        m = match(source, pos)
+        if m is None:
+            raise ParseError("Unexpected character %r %s" % (source[pos], location(source, pos)))
+        kind = m.lastgroup
+        if kind == 'space':
+            adjacent = False
+        else:
+            text = m.group(kind)
+            if kind == 'str':
+                yield (STR, text[1:-1], pos, adjacent)
+            elif kind == 'lt_neg':
+                # `a <-1` compares with a negative number, it is not a `<-`.
+                yield (OP, '<', pos, adjacent)
+            else:
+                # Names and operators repeat throughout the AST.
+                yield (kind, intern(text), pos, adjacent)
+            adjacent = True
+        pos = m.end()
+    yield (EOF, None, end, False)
+
+def location(source, pos):
+    line = source.count("\n", 0, pos) + 1
+    col = pos - (source.rfind("\n", 0, pos) + 1) + 1
+    return "(line:%d, col:%d)" % (line, col)
+
+class Fail(Exception):
+    pass
+
+class Parser:
+    def __init__(self, source):
+        self.source = source
+        # Tokens are lexed on demand. Those before the current top-level
+        # statement, further back than the parser ever rewinds, are dropped.
+        self.lexer = tokenize(source)
+        self.tokens = []
+        self.base = 0
+        self.pos = 0
+        self.furthest = 0
+        self.memo = {}
+        self.newlines = [m.start() for m in re.finditer("\n", source)]
+
+    # Token helpers
+    def token(self, i):
+        while i >= len(self.tokens):
+            more = list(islice(self.lexer, 256))
+            if not more:
+                return self.tokens[-1]
+            self.tokens += more
+        return self.tokens[i]
+    def peek(self, n=0):
+        try:
+            return self.tokens[self.pos + n]
+        except IndexError:
+            return self.token(self.pos + n)
+    def line(self):
+        return bisect.bisect_left(self.newlines, self.peek()[2]) + 1
+    def fail(self):
+        if self.pos > self.furthest:
+            self.furthest = self.pos
+        raise Fail()
+    def is_op(self, value, n=0):
+        try:
+            t = self.tokens[self.pos + n]
+        except IndexError:
+            t = self.token(self.pos + n)
+        return t[0] == OP and t[1] == value
+    def is_word(self, value, n=0):
+        try:
+            t = self.tokens[self.pos + n]
+        except IndexError:
+            t = self.token(self.pos + n)
+        return t[0] == NAME and t[1] == value
+    def op(self, value):
+        if not self.is_op(value):
+            self.fail()
+        self.pos += 1
+    def word(self, value):
+        if not self.is_word(value):
+            self.fail()
+        self.pos += 1
+    def attempt(self, rule, *args):
+        """Runs a rule, rewinding and returning None when it does not match."""
+        pos = self.pos
+        try:
+            return rule(*args)
+        except Fail:
+            self.pos = pos
+            return None
+    def delimited(self, rule, closing):
+        items = []
+        if not self.is_op(closing):
+            items.append(rule())
+            while self.is_op(','):
+                self.pos += 1
+                items.append(rule())
+        self.op(closing)
+        return items
+
+    # Literals
+    def ident(self):
+        t = self.peek()
+        if t[0] != NAME:
+            self.fail()
+        self.pos += 1
+        return ['IDENT', t[1]]
+    def package_name(self):
+        name = self.ident()[1]
+        while self.is_op('.') and self.peek()[3] and self.peek(1)[0] == NAME and self.peek(1)[3]:
+            name += "." + self.peek(1)[1]
+            self.pos += 2
+        return ['PACKAGE_NAME', name]
+    def number(self):
+        t = self.peek()
+        sign = ""
+        if t[0] == OP and t[1] in "+-" and self.peek(1)[0] in (INT, REAL) and self.peek(1)[3]:
+            sign = t[1]
+            self.pos += 1
+            t = self.peek()
+        if t[0] == REAL:
+            self.pos += 1
+            return ['REAL', float(sign + t[1])]
+        elif t[0] == INT:
+            self.pos += 1
+            return ['INTEGER', int(sign + t[1])]
+        self.fail()
+
+    def expr_literal(self):
+        t = self.peek()
+        if t[0] == NAME:
+            if t[1] in BOOLS:
+                self.pos += 1
+                return ['BOOL', t[1]]
+            elif t[1] == 'nil':
+                self.pos += 1
+                return ['NIL', 'nil']
+            elif t[1] == 'func':
+                r = self.attempt(self.literal_func)
+                if r is not None:
+                    return r
+            elif t[1] == 'var':
+                r = self.attempt(self.literal_var)
+                if r is not None:
+                    return r
+            return self.expr_rvalue()
+        elif t[0] == STR:
+            self.pos += 1
+            return ['STRING', t[1]]
+        elif t[0] == OP and t[1] == '[':
+            self.pos += 1
+            return ['LIST', self.delimited(self.expr, ']')]
+        elif t[0] == OP and t[1] == '{':
+            self.pos += 1
+            return ['DICT', self.delimited(self.dict_item, '}')]
+        return self.number()
+    def dict_item(self):
+        k = self.expr_literal()
+        self.op(':')
+        return [k, self.expr()]
+    def literal_func(self):
+        self.word('func')
+        return ['FUNC', [self.def_func_args(), self.def_stat_block()]]
+    def literal_var(self):
+        self.word('var')
+        return ['VAR', self.def_stat_block()]
+
+    # Expressions
+    def expr(self):
+        start = self.pos
+        if start in self.memo:
+            r, self.pos = self.memo[start]
+            if r is None:
+                self.fail()
+            return r
+        try:
+            r = ['expr', [self.operation(len(OPERATORS) - 1)]]
+        except Fail:
+            self.memo[start] = (None, start)
+            raise
+        self.memo[start] = (r, self.pos)
+        return r
+    def operator(self, ops):
+        t = self.peek()
+        if t[0] in (OP, NAME) and t[1] in ops:
+            self.pos += 1
+            return t[1]
+        return None
+    def operation(self, level):
+        if level < 0:
+            if self.is_op('('):
+                self.pos += 1
+                r = self.operation(len(OPERATORS) - 1)
+                self.op(')')
+                return r
+            return self.expr_literal()
+        ops, arity, assoc = OPERATORS[level]
+        if assoc == RIGHT:
+            start = self.pos
+            op = self.operator(ops)
+            if op is not None:
+                operand = self.attempt(self.operation, level)
+                if operand is not None:
+                    return [op, operand]
+                self.pos = start
+            return self.operation(level - 1)
+        operand = self.operation(level - 1)
+        group = [operand]
+        while True:
+            start = self.pos
+            op = self.operator(ops)
+            if op is None:
+                break
+            if arity == 1:
+                group.append(op)
+                continue
+            rhs = self.attempt(self.operation, level - 1)
+            if rhs is None:
+                self.pos = start
+                break
+            group += [op, rhs]
+        return group if len(group) > 1 else operand
+
+    def expr_rvalue(self):
+        r = [self.ident()]
+        while True:
+            t = self.peek()
+            if t[0] != OP:
+                break
+            if t[1] == '[':
+                self.pos += 1
+                e = self.expr()
+                self.op(']')
+                r.append(['expr_rvalue_item', e])
+            elif t[1] == '.' and self.peek(1)[0] == NAME:
+                self.pos += 1
+                r.append(['expr_rvalue_attr', self.ident()])
+            elif t[1] == '(':
+                call = self.attempt(self.expr_rvalue_call)
+                if call is None:
+                    break
+                r.append(call)
+            else:
+                break
+        return ['expr_rvalue', r]
+    def expr_rvalue_call(self):
+        self.op('(')
+        return ['expr_rvalue_call', self.delimited(self.call_argument, ')')]
+    def call_argument(self):
+        kwarg = self.attempt(self.expr_func_kwarg)
+        if kwarg is not None:
+            return kwarg
+        return self.expr()
+    def expr_func_kwarg(self):
+        name = self.ident()
+        self.op('=')
+        return ['expr_func_kwarg', [name, self.expr()]]
+
+    def expr_lvalue(self):
+        r = [self.ident()]
+        while True:
+            if self.is_op('['):
+                item = self.attempt(self.expr_lvalue_item)
+                if item is None:
+                    break
+                r.append(item)
+            elif self.is_op('.') and self.peek(1)[0] == NAME:
+                self.pos += 1
+                r.append(['expr_lvalue_attr', self.ident()])
+            else:
+                break
+        return ['expr_lvalue', r]
+    def expr_lvalue_item(self):
+        self.op('[')
+        e = self.expr()
+        self.op(']')
+        return ['expr_lvalue_item', e]
+
+    # Blocks
+    def def_func_arg(self):
+        r = [self.ident()]
+        if self.is_op('='):
+            start = self.pos
+            self.pos += 1
+            e = self.attempt(self.expr)
+            if e is None:
+                self.pos = start
+            else:
+                r.append(e)
+        return ['def_func_arg', r]
+    def def_func_args(self):
+        self.op('(')
+        return self.delimited(self.def_func_arg, ')')
+    def stat_one_line(self):
+        line = self.line()
+        return ['stat', self.stat_ret(), line]
+    def def_stat_block(self):
+        if self.is_op('{'):
+            self.pos += 1
+            return self.stats('}')
+        return [self.stat_one_line()]
+    def expr_stat_block(self):
+        if self.is_op(','):
+            self.pos += 1
+            return [self.stat()]
+        self.op('{')
+        return self.stats('}')
+    def stats(self, closing):
+        r = []
+        while not self.is_op(closing):
+            r.append(self.stat())
+        self.pos += 1
+        return r
+
+    # Statements
+    def stat(self):
+        t = self.peek()
+        line = self.line()
+        r = None
+        if t[0] == NAME and t[1] in self.keyword_stats:
+            r = self.attempt(self.keyword_stats[t[1]], self)
+        if r is None:
+            r = self.attempt(self.stat_assign)
+        if r is None:
+            r = self.attempt(self.stat_augmented_assign)
+        if r is None:
+            if self.is_op('='):
+                r = self.stat_ret()
+            else:
+                r = ['stat_expr', self.expr()]
+        if self.is_op(';'):
+            self.pos += 1
+        return ['stat', r, line]
+    def stat_assign(self):
+        start = self.pos
+        lvalue = self.expr_lvalue()
+        if self.is_op('('):
+            args = self.attempt(self.def_func_args)
+            if args is not None:
+                block = self.attempt(self.def_stat_block)
+                if block is not None:
+                    return ['stat_assign', [['def_func', [lvalue, args]], block]]
+            self.pos = start
+            lvalue = self.expr_lvalue()
+        return ['stat_assign', [['def_var', lvalue], self.def_stat_block()]]
+    def stat_augmented_assign(self):
+        lvalue = self.expr_lvalue()
+        op = self.operator(AUGMENTED_ASSIGNMENTS)
+        if op is None:
+            self.fail()
+        return ['stat_augmented_assign', [op, lvalue, self.expr()]]
+    def stat_ret(self):
+        self.op('=')
+        return ['stat_ret', self.expr()]
+    def stat_def_class(self):
+        self.word('class')
+        name = self.ident()
+        self.op('{')
+        members = []
+        while not self.is_op('}'):
+            t = self.peek()
+            if t[0] != NAME or t[1] not in self.class_members:
+                self.fail()
+            members.append(self.class_members[t[1]](self))
+        self.pos += 1
+        return ['stat_def_class', [name, members]]
+    def stat_class_method(self):
+        self.word('method')
+        return ['stat_class_method', [self.ident(), self.def_func_args(), self.def_stat_block()]]
+    def stat_class_operator(self):
+        self.word('operator')
+        op = self.operator(CLASS_OPERATORS)
+        if op is None:
+            self.fail()
+        return ['stat_class_operator', [[op], self.def_func_args(), self.def_stat_block()]]
+    def stat_class_property(self):
+        self.word('property')
+        return ['stat_class_property', [self.ident(), self.def_stat_block()]]
+    def stat_class_constructor(self):
+        self.word('constructor')
+        return ['stat_class_constructor', [self.def_func_args(), self.def_stat_block()]]
+    def stat_class_destructor(self):
+        self.word('destructor')
+        return ['stat_class_destructor', [self.def_func_args(), self.def_stat_block()]]
+    def stat_import(self):
+        self.word('import')
+        r = [self.package_name()]
+        if self.is_word('as'):
+            self.pos += 1
+            r.append(self.ident())
+        return ['stat_import', [r]]
+    def stat_export(self):
+        self.word('export')
+        r = [self.ident()]
+        if self.is_word('as'):
+            self.pos += 1
+            r.append(self.ident())
+        return ['stat_export', [r]]
+    def stat_try(self):
+        self.word('try')
+        r = [self.expr_stat_block()]
+        while self.is_word('except'):
+            self.pos += 1
+            r.append([self.expr_rvalue(), self.ident(), self.expr_stat_block()])
+        if len(r) == 1:
+            self.fail()
+        if self.is_word('finally'):
+            self.pos += 1
+            r.append([self.expr_stat_block()])
+        return ['stat_try', r]
+    def stat_raise(self):
+        self.word('raise')
+        return ['stat_raise', self.expr()]
+    def stat_yield(self):
+        self.word('yield')
+        return ['stat_yield', self.expr()]
+    def stat_if(self):
+        self.word('if')
+        r = [[self.expr(), self.expr_stat_block()]]
+        while self.is_word('elif'):
+            self.pos += 1
+            r.append([self.expr(), self.expr_stat_block()])
+        if self.is_word('else'):
+            self.pos += 1
+            r.append([self.expr_stat_block()])
+        return ['stat_if', r]
+    def stat_for(self):
+        self.word('for')
+        ident = self.ident()
+        self.word('in')
+        return ['stat_for', [ident, self.expr(), self.expr_stat_block()]]
+    def stat_while(self):
+        self.word('while')
+        return ['stat_while', [self.expr(), self.expr_stat_block()]]
+    def stat_break(self):
+        self.word('break')
+        return ['stat_break']
+    def stat_continue(self):
+        self.word('continue')
+        return ['stat_continue']
+
+    keyword_stats = {
+        'class': stat_def_class,
+        'import': stat_import,
+        'export': stat_export,
+        'try': stat_try,
+        'raise': stat_raise,
+        'yield': stat_yield,
+        'if': stat_if,
+        'for': stat_for,
+        'while': stat_while,
+        'break': stat_break,
+        'continue': stat_continue,
+    }
+    class_members = {
+        'method': stat_class_method,
+        'operator': stat_class_operator,
+        'property': stat_class_property,
+        'constructor': stat_class_constructor,
+        'destructor': stat_class_destructor,
+    }
+
+    # Program
+    def program(self):
+        stats = []
+        while self.peek()[0] != EOF:
+            # Top-level statements never backtrack into each other.
+            self.memo.clear()
+            self.tokens[self.base:self.pos] = [None] * (self.pos - self.base)
+            self.base = self.pos
+            stat = self.attempt(self.stat)
+            if stat is None:
+                break
+            stats.append(stat)
+        if self.peek()[0] != EOF:
+            pos = max(self.pos, self.furthest)
+            t = self.token(pos)
+            found = "end of text" if t[0] == EOF else repr(t[1])
+            raise ParseError("Unexpected %s %s" % (found, location(self.source, t[2])))
+        return ['program', stats]
+
 def parse(source):
-  return program.parseString(source, parseAll=True)
+    limit = sys.getrecursionlimit()
+    sys.setrecursionlimit(max(limit, 20000))
+    # The AST is acyclic; collecting while it grows only costs time.
+    collecting = gc.isenabled()
+    gc.disable()
+    try:
+        return Parser(source).program()
+    finally:
+        sys.setrecursionlimit(limit)
+        if collecting:
+            gc.enable()